@@ -34,6 +34,12 @@ extern "C" {
     GGML_BACKEND_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_BACKEND_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // with the distribute strategy the rows of a matrix are split into one contiguous block per node and
+    // only the threads of that node multiply them, binding the blocks to their node keeps weight reads local
+    GGML_BACKEND_API int     ggml_numa_n_nodes(void); // nodes the distribute strategy spreads over, 0 otherwise
+    GGML_BACKEND_API int     ggml_numa_node_cpus(int node, uint32_t * cpus, int n_cpus_max); // returns the number of cpus
+    GGML_BACKEND_API bool    ggml_numa_place_tensor(const struct ggml_tensor * tensor, size_t * node_bytes); // adds the bytes bound per node
+
     GGML_BACKEND_API struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
     GGML_BACKEND_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
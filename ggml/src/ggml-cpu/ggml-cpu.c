@@ -2377,6 +2377,76 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+int ggml_numa_n_nodes(void) {
+    if (!ggml_is_numa() || g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_DISTRIBUTE) {
+        return 0;
+    }
+    return g_state.numa.n_nodes;
+}
+
+int ggml_numa_node_cpus(int node, uint32_t * cpus, int n_cpus_max) {
+    if (node < 0 || (uint32_t) node >= g_state.numa.n_nodes) {
+        return 0;
+    }
+    const int n_cpus = (int) g_state.numa.nodes[node].n_cpus;
+    for (int i = 0; i < n_cpus && i < n_cpus_max; ++i) {
+        cpus[i] = g_state.numa.nodes[node].cpus[i];
+    }
+    return n_cpus;
+}
+
+// rows of the block each node multiplies, even so that the 2 row kernels keep working on every block
+static int64_t ggml_numa_node_rows(int64_t nr, int n_nodes) {
+    return (((nr + n_nodes - 1)/n_nodes) + 1) & ~(int64_t) 1;
+}
+
+bool ggml_numa_place_tensor(const struct ggml_tensor * tensor, size_t * node_bytes) {
+#if defined(__gnu_linux__) && defined(SYS_mbind)
+    const int n_nodes = ggml_numa_n_nodes();
+    if (n_nodes == 0 || tensor->data == NULL || !ggml_is_contiguous(tensor) || tensor->ne[1] < 2) {
+        return false;
+    }
+
+    // only whole pages can be bound, a page shared by two blocks stays where it is
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const int64_t   rows = ggml_numa_node_rows(tensor->ne[1], n_nodes);
+
+    for (int64_t i3 = 0; i3 < tensor->ne[3]; i3++) {
+        for (int64_t i2 = 0; i2 < tensor->ne[2]; i2++) {
+            const char * base = (const char *) tensor->data + i2*tensor->nb[2] + i3*tensor->nb[3];
+            for (int n = 0; n < n_nodes; ++n) {
+                const int64_t ir0 = n*rows;
+                const int64_t ir1 = MIN(tensor->ne[1], ir0 + rows);
+                if (ir0 >= ir1) {
+                    break;
+                }
+
+                const uintptr_t first = ((uintptr_t) (base + ir0*tensor->nb[1]) + page - 1) & ~(page - 1);
+                const uintptr_t last  =  (uintptr_t) (base + ir1*tensor->nb[1])              & ~(page - 1);
+                if (last <= first) {
+                    continue;
+                }
+
+                // MPOL_BIND, MPOL_MF_MOVE migrates pages that were touched already
+                unsigned long mask = 1UL << n;
+                if (syscall(SYS_mbind, (void *) first, last - first, 2, &mask, sizeof(mask)*8, 1 << 1) != 0) {
+                    return false;
+                }
+                if (node_bytes) {
+                    node_bytes[n] += last - first;
+                }
+            }
+        }
+    }
+
+    return true;
+#else
+    UNUSED(tensor);
+    UNUSED(node_bytes);
+    return false;
+#endif
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -7494,6 +7564,30 @@ UseGgmlGemm2:;
     // This is the size of the rest of the dimensions of the result
     const int64_t nr1 = ne1 * ne2 * ne3;
 
+    // Distributed over NUMA nodes, thread ith runs on node ith % n_nodes. Every node takes the block of src0 rows
+    // ggml_numa_place_tensor binds to its memory and splits it between its own threads.
+    const int n_nodes = ggml_numa_n_nodes();
+    if (n_nodes > 0 && nth >= n_nodes && nr0 > nr1) {
+        const int     node    = ith % n_nodes;
+        const int     n_local = (nth - node + n_nodes - 1) / n_nodes;
+        const int64_t rows    = ggml_numa_node_rows(nr0, n_nodes);
+
+        const int64_t node_start = MIN(nr0, node*rows);
+        const int64_t node_end   = MIN(nr0, node_start + rows);
+        const int64_t dr0        = (((node_end - node_start + n_local - 1) / n_local) + 1) & ~(int64_t) 1;
+
+        const int64_t ir0_start = MIN(node_end, node_start + (ith / n_nodes)*dr0);
+        const int64_t ir0_end   = MIN(node_end, ir0_start + dr0);
+
+        if (ir0_start < ir0_end) {
+            // same constraints as the chunked loop below
+            const bool    odd                  = (nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || (nr1 % 2 != 0);
+            const int64_t num_rows_per_vec_dot = odd ? 1 : vec_dot_num_rows;
+            ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, 0, nr1);
+        }
+        return;
+    }
+
     // Now select a reasonable chunk size.
     int chunk_size = 16;
 
@@ -12827,6 +12921,9 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
 
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__gnu_linux__)
+// node the calling thread is pinned to, pool threads keep their ith between graphs so they are only pinned once
+static __thread int ggml_numa_thread_node = -1;
+
 static void set_numa_thread_affinity(int thread_n) {
     if (!ggml_is_numa()) {
         return;
@@ -12856,6 +12953,10 @@ static void set_numa_thread_affinity(int thread_n) {
             return;
     }
 
+    if (node_num == ggml_numa_thread_node) {
+        return;
+    }
+
     struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
 
     cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
@@ -12867,6 +12968,8 @@ static void set_numa_thread_affinity(int thread_n) {
     rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
     if (rv) {
             fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    } else {
+        ggml_numa_thread_node = node_num;
     }
 
     CPU_FREE(cpus);
@@ -12877,6 +12980,8 @@ static void clear_numa_thread_affinity(void) {
         return;
     }
 
+    ggml_numa_thread_node = -1;
+
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
     cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
@@ -588,6 +588,15 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_is_numa") == 0) {
         return (void *)ggml_is_numa;
     }
+    if (strcmp(name, "ggml_backend_cpu_numa_n_nodes") == 0) {
+        return (void *)ggml_numa_n_nodes;
+    }
+    if (strcmp(name, "ggml_backend_cpu_numa_node_cpus") == 0) {
+        return (void *)ggml_numa_node_cpus;
+    }
+    if (strcmp(name, "ggml_backend_cpu_numa_place_tensor") == 0) {
+        return (void *)ggml_numa_place_tensor;
+    }
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
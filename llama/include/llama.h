@@ -285,6 +285,9 @@ extern "C" {
         // the GPU that is used for the entire model when split_mode is LLAMA_SPLIT_MODE_NONE
         int32_t main_gpu;
 
+        // threads reading the weights (or touching the mapped pages with use_prefetch), <= 1 loads on the calling thread
+        int32_t n_threads_load;
+
         // proportion of the model (layers or rows) to offload to each GPU, size: llama_max_devices()
         const float * tensor_split;
 
@@ -307,12 +310,15 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_prefetch;  // read the whole file ahead when it gets mapped, otherwise pages are read on first use
+        bool numa_place;    // with the NUMA distribute strategy, bind each node's share of the weights to its memory (reads them instead of mapping)
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
     //       https://github.com/ggerganov/llama.cpp/pull/7544
     struct llama_context_params {
         uint32_t n_ctx;             // text context, 0 = from model
+        uint32_t n_ctx_init;        // initial KV cache size, grows on demand up to n_ctx, 0 = allocate n_ctx up front
         uint32_t n_batch;           // logical maximum batch size that can be submitted to llama_decode
         uint32_t n_ubatch;          // physical maximum batch size
         uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models)
@@ -484,6 +490,10 @@ extern "C" {
     // Returns the total number of parameters in the model
     LLAMA_API uint64_t llama_model_n_params(const struct llama_model * model);
 
+    // Returns the number of NUMA nodes the weights were placed on and fills node_bytes with the bytes bound to each of them
+    // 0 if numa_place was not set or the distribute strategy is not active
+    LLAMA_API int32_t llama_model_numa_layout(const struct llama_model * model, size_t * node_bytes, int32_t n_max);
+
     // Returns true if the model contains an encoder that requires llama_encode() call
     LLAMA_API bool llama_model_has_encoder(const struct llama_model * model);
 
@@ -616,6 +626,12 @@ extern "C" {
     // Returns the number of used KV cells (i.e. have at least one sequence assigned to them)
     LLAMA_API int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx);
 
+    // Returns the size in bytes of the K and V buffers currently allocated, the cache grows on demand
+    LLAMA_API size_t llama_get_kv_cache_size(const struct llama_context * ctx);
+
+    // Returns the size in bytes the K and V buffers reach once the cache holds n_ctx cells
+    LLAMA_API size_t llama_get_kv_cache_size_max(const struct llama_context * ctx);
+
     // Clear the KV cache - both cell info is erased and KV data is zeroed
     LLAMA_API void llama_kv_cache_clear(
             struct llama_context * ctx);
@@ -1149,6 +1165,7 @@ extern "C" {
                                float   tau,
                                float   eta);
 
+    /// @details Returns NULL when the grammar fails to parse. Cloning a grammar sampler copies the parsed grammar.
     LLAMA_API struct llama_sampler * llama_sampler_init_grammar(
             const struct llama_model * model,
                           const char * grammar_str,
@@ -1176,13 +1176,13 @@ struct llama_data_read {
         } else {
             // whole KV cache restore
 
-            if (cell_count > kv_self.size) {
+            llama_kv_cache_clear(kv_self);
+
+            if (!llama_kv_cache_reserve(kv_self, cell_count)) {
                 LLAMA_LOG_ERROR("%s: not enough cells in kv cache\n", __func__);
                 return false;
             }
 
-            llama_kv_cache_clear(kv_self);
-
             for (uint32_t i = 0; i < cell_count; ++i) {
                 llama_kv_cell & cell = kv_self.cells[i];
 
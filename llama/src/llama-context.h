@@ -88,6 +88,27 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_ptr sched;
 
+    // the last decode graph, kept allocated in the scheduler and reused for ubatches of the same shape
+    // only the K/V store views depend on the cache head, they are moved in place before each reuse
+    // any other graph built in buf_compute_meta or reset of the scheduler must clear gf
+    struct llama_graph_cache {
+        ggml_cgraph * gf = nullptr;
+
+        uint32_t n_tokens     = 0;
+        uint32_t n_seq_tokens = 0;
+        uint32_t n_seqs       = 0;
+        bool     equal_seqs   = false;
+        bool     token        = false;
+        int32_t  n_outputs    = 0;
+        uint32_t n_kv         = 0;
+        uint32_t n_realloc    = 0;
+        bool     embeddings   = false;
+        bool     causal_attn  = false;
+
+        // copy nodes into the K/V cache and the byte offset of one cell in the destination
+        std::vector<std::pair<ggml_tensor *, size_t>> kv_stores;
+    } graph_cache;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
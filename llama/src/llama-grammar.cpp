@@ -6,7 +6,10 @@
 
 #include <cmath>
 #include <algorithm>
+#include <iterator>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_map>
 
 //
 // helpers
@@ -903,6 +906,226 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+//
+// token masks
+//
+
+// prefix trie over the decoded pieces of the vocab, so that tokens sharing a prefix are
+// matched against the grammar stacks once and whole subtrees are dropped on the first mismatch
+struct llama_grammar_trie {
+    struct node {
+        std::vector<std::pair<uint32_t, uint32_t>>              children; // code point, node index
+        std::vector<std::pair<llama_token, llama_partial_utf8>> tokens;   // tokens whose code points end here
+    };
+
+    std::vector<node>        nodes;
+    std::vector<llama_token> eog;
+};
+
+// allowed-token bitmasks keyed by grammar state; a grammar sampler sees the same few states
+// over and over (e.g. inside a JSON string), so the walk only runs on the first visit.
+// the trie and the masks of every grammar over a vocab live together under one memory budget
+struct llama_grammar_vocab_masks {
+    static constexpr size_t MAX_BYTES = 64u << 20;
+
+    std::mutex mutex;
+
+    std::unique_ptr<llama_grammar_trie> trie; // built on first use
+
+    // keyed by grammar id and state
+    std::unordered_map<std::string, std::shared_ptr<const std::vector<uint64_t>>> masks;
+    size_t bytes = 0;
+};
+
+// a grammar and its clones, which lay out their rules the same way and so share state keys
+struct llama_grammar_masks {
+    uint64_t id;
+
+    std::shared_ptr<llama_grammar_vocab_masks> vocab;
+};
+
+static std::shared_ptr<llama_grammar_masks> llama_grammar_masks_init(const llama_vocab * vocab) {
+    if (vocab == nullptr) {
+        return nullptr;
+    }
+
+    static std::mutex mutex;
+    static uint64_t   next_id = 0;
+    // grammars keep their vocab alive, so an expired entry is the only thing a reused address can find
+    static std::unordered_map<const llama_vocab *, std::weak_ptr<llama_grammar_vocab_masks>> by_vocab;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto & entry = by_vocab[vocab];
+    auto shared = entry.lock();
+    if (!shared) {
+        shared = std::make_shared<llama_grammar_vocab_masks>();
+        entry  = shared;
+    }
+
+    for (auto it = by_vocab.begin(); it != by_vocab.end();) {
+        it = it->second.expired() ? by_vocab.erase(it) : std::next(it);
+    }
+
+    return std::make_shared<llama_grammar_masks>(llama_grammar_masks { next_id++, std::move(shared) });
+}
+
+static std::unique_ptr<llama_grammar_trie> llama_grammar_trie_build(const llama_vocab & vocab) {
+    std::unique_ptr<llama_grammar_trie> trie(new llama_grammar_trie());
+    trie->nodes.emplace_back();
+
+    std::unordered_map<uint64_t, uint32_t> edges;
+
+    for (llama_token id = 0; id < (llama_token) vocab.cache_token_to_piece.size(); ++id) {
+        if (llama_token_is_eog_impl(vocab, id)) {
+            trie->eog.push_back(id);
+            continue;
+        }
+
+        const std::string & piece = vocab.cache_token_to_piece[id];
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        // note terminating 0 in decoded string; invalid sequences never match
+        const auto decoded = decode_utf8(piece, { 0, 0 });
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+
+        uint32_t node = 0;
+        for (auto it = decoded.first.begin(), end = decoded.first.end() - 1; it != end; ++it) {
+            const uint64_t key = ((uint64_t) node << 32) | *it;
+            const auto found = edges.find(key);
+            if (found != edges.end()) {
+                node = found->second;
+                continue;
+            }
+
+            const uint32_t child = (uint32_t) trie->nodes.size();
+            trie->nodes.emplace_back();
+            trie->nodes[node].children.emplace_back(*it, child);
+            edges.emplace(key, child);
+            node = child;
+        }
+        trie->nodes[node].tokens.emplace_back(id, decoded.second);
+    }
+
+    return trie;
+}
+
+// marks every token below node that some stack can accept, mirroring llama_grammar_reject_candidates
+static void llama_grammar_trie_walk(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_trie   & trie,
+        uint32_t                     node_id,
+        const llama_grammar_stacks & stacks,
+        std::vector<uint64_t>      & mask) {
+    const auto & node = trie.nodes[node_id];
+
+    for (const auto & tok : node.tokens) {
+        // all code points matched; a trailing partial sequence must still fit some stack
+        bool allowed = tok.second.n_remain == 0;
+        for (size_t i = 0; !allowed && i < stacks.size(); ++i) {
+            allowed = !stacks[i].empty() && llama_grammar_match_partial_char(stacks[i].back(), tok.second);
+        }
+        if (allowed) {
+            mask[tok.first >> 6] |= 1ull << (tok.first & 63);
+        }
+    }
+
+    llama_grammar_stacks next_stacks;
+    for (const auto & child : node.children) {
+        next_stacks.clear();
+        for (const auto & stack : stacks) {
+            if (stack.empty()) {
+                continue;
+            }
+
+            auto match = llama_grammar_match_char(stack.back(), child.first);
+            if (match.first) {
+                llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+                if (!llama_grammar_is_end_of_sequence(match.second)) {
+                    new_stack.push_back(match.second);
+                }
+                llama_grammar_advance_stack(rules, new_stack, next_stacks);
+            }
+        }
+
+        if (!next_stacks.empty()) {
+            llama_grammar_trie_walk(rules, trie, child.second, next_stacks, mask);
+        }
+    }
+}
+
+// serializes the stacks as element offsets into the rules, which are the same for every clone
+static std::string llama_grammar_state_key(const llama_grammar & grammar) {
+    std::vector<uint32_t> key;
+    for (const auto & stack : grammar.stacks) {
+        key.push_back((uint32_t) stack.size());
+        for (const auto * pos : stack) {
+            uint32_t offset = 0;
+            for (const auto & rule : grammar.rules) {
+                if (pos >= rule.data() && pos < rule.data() + rule.size()) {
+                    offset += (uint32_t) (pos - rule.data());
+                    break;
+                }
+                offset += (uint32_t) rule.size();
+            }
+            key.push_back(offset);
+        }
+    }
+
+    return std::string((const char *) key.data(), key.size() * sizeof(uint32_t));
+}
+
+static std::shared_ptr<const std::vector<uint64_t>> llama_grammar_get_mask(const llama_grammar & grammar) {
+    auto & cache = *grammar.masks->vocab;
+    const std::string key = std::string((const char *) &grammar.masks->id, sizeof(uint64_t)) + llama_grammar_state_key(grammar);
+
+    const llama_grammar_trie * trie;
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        const auto found = cache.masks.find(key);
+        if (found != cache.masks.end()) {
+            return found->second;
+        }
+        if (!cache.trie) {
+            cache.trie = llama_grammar_trie_build(*grammar.vocab);
+        }
+        trie = cache.trie.get();
+    }
+
+    const size_t n_tokens = grammar.vocab->cache_token_to_piece.size();
+    std::vector<uint64_t> mask((n_tokens + 63) / 64, 0);
+
+    llama_grammar_trie_walk(grammar.rules, *trie, 0, grammar.stacks, mask);
+
+    for (const auto & stack : grammar.stacks) {
+        if (stack.empty()) {
+            for (const llama_token id : trie->eog) {
+                mask[id >> 6] |= 1ull << (id & 63);
+            }
+            break;
+        }
+    }
+
+    const size_t bytes = mask.size() * sizeof(uint64_t);
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.bytes + bytes > llama_grammar_vocab_masks::MAX_BYTES) {
+        cache.masks.clear();
+        cache.bytes = 0;
+    }
+
+    auto result = std::make_shared<const std::vector<uint64_t>>(std::move(mask));
+    if (cache.masks.emplace(key, result).second) {
+        cache.bytes += bytes;
+    }
+
+    return result;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -960,7 +1183,7 @@ struct llama_grammar * llama_grammar_init_impl(
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, llama_grammar_masks_init(vocab), };
 }
 
 struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab, const char * grammar_str, const char * grammar_root) {
@@ -1038,7 +1261,7 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, llama_grammar_masks_init(vocab), };
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -1055,6 +1278,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.rules,
         grammar.stacks,
         grammar.partial_utf8,
+        grammar.masks,
     };
 
     // redirect elements in stacks to point to new rules
@@ -1076,6 +1300,19 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
 void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
+    // mid-sequence states depend on the pending bytes, so only whole code point states are cached
+    if (grammar.masks && grammar.partial_utf8.n_remain == 0) {
+        const auto mask = llama_grammar_get_mask(grammar);
+        const uint64_t * bits = mask->data();
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+            if (!((bits[id >> 6] >> (id & 63)) & 1)) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        }
+        return;
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar.stacks) {
         if (stack.empty()) {
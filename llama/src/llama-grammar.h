@@ -3,10 +3,12 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
 struct llama_vocab;
+struct llama_grammar_masks;
 
 // grammar element type
 enum llama_gretype {
@@ -114,6 +116,10 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // allowed-token masks per grammar state, shared between clones; the vocab trie and the memory
+    // budget are shared by all grammars over the same vocab
+    std::shared_ptr<llama_grammar_masks> masks;
 };
 
 //
@@ -6,6 +6,7 @@
 #include "llama-model.h"
 
 #include <algorithm>
+#include <cstring>
 #include <limits>
 #include <map>
 
@@ -16,37 +17,21 @@ uint32_t llama_kv_cache_get_padding(const struct llama_cparams & cparams) {
     return cparams.flash_attn ? 256u : 32u;
 }
 
-bool llama_kv_cache_init(
-             struct llama_kv_cache & cache,
-                 const llama_model & model,
-               const llama_cparams & cparams,
-                         ggml_type   type_k,
-                         ggml_type   type_v,
-                          uint32_t   kv_size,
-                              bool   offload) {
+// allocate the K and V tensors of all layers for kv_size cells
+static bool llama_kv_cache_alloc(
+                     const llama_model & model,
+                             ggml_type   type_k,
+                             ggml_type   type_v,
+                              uint32_t   kv_size,
+                                  bool   offload,
+          std::vector<ggml_tensor *> & k_l,
+          std::vector<ggml_tensor *> & v_l,
+       std::vector<ggml_context_ptr> & ctxs,
+std::vector<ggml_backend_buffer_ptr> & bufs) {
     const struct llama_hparams & hparams = model.hparams;
 
     const int32_t n_layer = hparams.n_layer;
 
-    cache.has_shift = false;
-
-    cache.recurrent = llama_model_is_recurrent(&model);
-    cache.v_trans   = !cache.recurrent && !cparams.flash_attn;
-    cache.can_shift = !cache.recurrent && model.arch != LLM_ARCH_DEEPSEEK2; // not supported due to MLA
-
-    LLAMA_LOG_INFO("%s: kv_size = %d, offload = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d\n",
-            __func__, kv_size, offload, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, cache.can_shift);
-
-    cache.head = 0;
-    cache.size = kv_size;
-    cache.used = 0;
-
-    cache.type_k = type_k;
-    cache.type_v = type_v;
-
-    cache.cells.clear();
-    cache.cells.resize(kv_size);
-
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
@@ -62,14 +47,14 @@ bool llama_kv_cache_init(
                 return nullptr;
             }
             ctx_map[buft] = ctx;
-            cache.ctxs.emplace_back(ctx);
+            ctxs.emplace_back(ctx);
             return ctx;
         }
         return it->second;
     };
 
-    cache.k_l.reserve(n_layer);
-    cache.v_l.reserve(n_layer);
+    k_l.reserve(n_layer);
+    v_l.reserve(n_layer);
 
     for (int i = 0; i < n_layer; i++) {
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(i) + hparams.n_embd_k_s();
@@ -95,8 +80,8 @@ bool llama_kv_cache_init(
         ggml_tensor * v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
         ggml_format_name(k, "cache_k_l%d", i);
         ggml_format_name(v, "cache_v_l%d", i);
-        cache.k_l.push_back(k);
-        cache.v_l.push_back(v);
+        k_l.push_back(k);
+        v_l.push_back(v);
     }
 
     // allocate tensors and initialize the buffers to avoid NaNs in the padding
@@ -111,12 +96,137 @@ bool llama_kv_cache_init(
         }
         ggml_backend_buffer_clear(buf, 0);
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
-        cache.bufs.emplace_back(buf);
+        bufs.emplace_back(buf);
+    }
+
+    return true;
+}
+
+bool llama_kv_cache_init(
+             struct llama_kv_cache & cache,
+                 const llama_model & model,
+               const llama_cparams & cparams,
+                         ggml_type   type_k,
+                         ggml_type   type_v,
+                          uint32_t   kv_size,
+                          uint32_t   kv_size_init,
+                              bool   offload) {
+    const struct llama_hparams & hparams = model.hparams;
+
+    const int32_t n_layer = hparams.n_layer;
+
+    cache.has_shift = false;
+
+    cache.recurrent = llama_model_is_recurrent(&model);
+    cache.v_trans   = !cache.recurrent && !cparams.flash_attn;
+    cache.can_shift = !cache.recurrent && model.arch != LLM_ARCH_DEEPSEEK2; // not supported due to MLA
+
+    cache.model    = &model;
+    cache.offload  = offload;
+    cache.padding  = llama_kv_cache_get_padding(cparams);
+    cache.size_max = kv_size;
+
+    // a growing cache still has to fit the worst-case ubatch used to reserve the compute buffers
+    if (kv_size_init > 0 && !cache.recurrent) {
+        kv_size_init = GGML_PAD(std::max(kv_size_init, std::min(cparams.n_ctx, cparams.n_ubatch)), cache.padding);
+        kv_size      = std::min(kv_size, kv_size_init);
+    }
+    cache.size_init = kv_size;
+
+    LLAMA_LOG_INFO("%s: kv_size = %d, kv_size_max = %d, offload = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d\n",
+            __func__, kv_size, cache.size_max, offload, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, cache.can_shift);
+
+    cache.head = 0;
+    cache.size = kv_size;
+    cache.used = 0;
+
+    cache.type_k = type_k;
+    cache.type_v = type_v;
+
+    cache.cells.clear();
+    cache.cells.resize(kv_size);
+
+    return llama_kv_cache_alloc(model, type_k, type_v, kv_size, offload, cache.k_l, cache.v_l, cache.ctxs, cache.bufs);
+}
+
+// reallocate the cache for kv_size cells, the data of the first min(size, kv_size) cells is kept
+static bool llama_kv_cache_resize(struct llama_kv_cache & cache, uint32_t kv_size) {
+    std::vector<ggml_tensor *> k_l;
+    std::vector<ggml_tensor *> v_l;
+    std::vector<ggml_context_ptr> ctxs;
+    std::vector<ggml_backend_buffer_ptr> bufs;
+
+    if (!llama_kv_cache_alloc(*cache.model, cache.type_k, cache.type_v, kv_size, cache.offload, k_l, v_l, ctxs, bufs)) {
+        return false;
+    }
+
+    const uint32_t n_keep = std::min(cache.size, cache.used > 0 ? llama_kv_cache_cell_max(cache) : 0u);
+
+    std::vector<uint8_t> src;
+    std::vector<uint8_t> dst;
+
+    for (size_t il = 0; il < k_l.size() && n_keep > 0; ++il) {
+        // one row per cell, the kept cells are a prefix of the tensor
+        const size_t k_row = ggml_nbytes(cache.k_l[il]) / cache.size;
+        src.resize(k_row*n_keep);
+        ggml_backend_tensor_get(cache.k_l[il], src.data(), 0, src.size());
+        ggml_backend_tensor_set(k_l[il], src.data(), 0, src.size());
+
+        if (!cache.v_trans) {
+            const size_t v_row = ggml_nbytes(cache.v_l[il]) / cache.size;
+            src.resize(v_row*n_keep);
+            ggml_backend_tensor_get(cache.v_l[il], src.data(), 0, src.size());
+            ggml_backend_tensor_set(v_l[il], src.data(), 0, src.size());
+            continue;
+        }
+
+        // transposed V has one row per embedding dimension with a stride of the cache size
+        const size_t  v_size_el = ggml_type_size(cache.v_l[il]->type);
+        const int64_t n_embd_v  = ggml_nelements(cache.v_l[il]) / cache.size;
+
+        src.resize(ggml_nbytes(cache.v_l[il]));
+        dst.assign(ggml_nbytes(v_l[il]), 0);
+        ggml_backend_tensor_get(cache.v_l[il], src.data(), 0, src.size());
+        for (int64_t j = 0; j < n_embd_v; ++j) {
+            memcpy(dst.data() + j*kv_size*v_size_el, src.data() + j*cache.size*v_size_el, n_keep*v_size_el);
+        }
+        ggml_backend_tensor_set(v_l[il], dst.data(), 0, dst.size());
+    }
+
+    cache.k_l  = std::move(k_l);
+    cache.v_l  = std::move(v_l);
+    cache.bufs = std::move(bufs);
+    cache.ctxs = std::move(ctxs);
+
+    cache.cells.resize(kv_size);
+    cache.size = kv_size;
+    cache.n_realloc++;
+    if (cache.head >= kv_size) {
+        cache.head = 0;
     }
 
     return true;
 }
 
+bool llama_kv_cache_reserve(
+        struct llama_kv_cache & cache,
+                     uint32_t   n_cells) {
+    if (n_cells <= cache.size) {
+        return true;
+    }
+
+    if (cache.recurrent || n_cells > cache.size_max) {
+        return false;
+    }
+
+    // double the size to keep the number of reallocations logarithmic
+    const uint32_t kv_size = std::min(cache.size_max, GGML_PAD(std::max(n_cells, 2*cache.size), cache.padding));
+
+    LLAMA_LOG_DEBUG("%s: growing kv cache from %u to %u cells\n", __func__, cache.size, kv_size);
+
+    return llama_kv_cache_resize(cache, kv_size);
+}
+
 struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
            struct llama_kv_cache & cache,
        const struct llama_ubatch & batch) {
@@ -288,7 +398,7 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
     }
     // otherwise, one cell per token.
 
-    if (n_tokens > cache.size) {
+    if (n_tokens > cache.size && !llama_kv_cache_reserve(cache, n_tokens)) {
         LLAMA_LOG_ERROR("%s: n_tokens=%d > cache.size=%d\n", __func__, n_tokens, cache.size);
         return llama_kv_cache_slot_info_failed;
     }
@@ -317,6 +427,12 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
         }
 
         if (n_tested >= cache.size) {
+            // no room left, grow and continue right after the last used cell
+            const uint32_t n_used = llama_kv_cache_cell_max(cache);
+            if (llama_kv_cache_reserve(cache, n_used + n_tokens)) {
+                cache.head = n_used;
+                break;
+            }
             //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
             return llama_kv_cache_slot_info_failed;
         }
@@ -360,6 +476,11 @@ void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     cache.head = 0;
     cache.used = 0;
 
+    // give the memory of a grown cache back, the new buffers are already cleared
+    if (cache.size > cache.size_init && llama_kv_cache_resize(cache, cache.size_init)) {
+        return;
+    }
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -619,6 +740,21 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_kv_cache & kv) {
     return kv.used;
 }
 
+size_t llama_get_kv_cache_size_max(const struct llama_kv_cache & kv) {
+    if (kv.size == 0) {
+        return 0;
+    }
+
+    // K and V rows are whole blocks, so the tensors scale linearly with the number of cells
+    size_t size = 0;
+    for (size_t il = 0; il < kv.k_l.size(); ++il) {
+        size += ggml_nbytes(kv.k_l[il]) / kv.size * kv.size_max;
+        size += ggml_nbytes(kv.v_l[il]) / kv.size * kv.size_max;
+    }
+
+    return size;
+}
+
 bool llama_kv_cache_can_shift(const struct llama_kv_cache & kv) {
     return kv.can_shift;
 }
@@ -57,6 +57,16 @@ struct llama_kv_cache {
     std::vector<ggml_context_ptr> ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    // the cache can start smaller than the context and grow on demand up to size_max
+    const llama_model * model = nullptr;
+    bool     offload   = false;
+    uint32_t padding   = 1;
+    uint32_t size_init = 0;
+    uint32_t size_max  = 0;
+
+    // bumped whenever the tensors are reallocated, graphs that reference the old ones are stale
+    uint32_t n_realloc = 0;
+
     size_t total_size() const {
         size_t size = 0;
         for (const auto & buf : bufs) {
@@ -98,8 +108,15 @@ bool llama_kv_cache_init(
                     ggml_type   type_k,
                     ggml_type   type_v,
                      uint32_t   kv_size,
+                     uint32_t   kv_size_init,
                          bool   offload);
 
+// grow the cache so it holds at least n_cells cells, keeping the cached data
+// returns false if that exceeds the maximum size or the allocation fails
+bool llama_kv_cache_reserve(
+        struct llama_kv_cache & cache,
+                     uint32_t   n_cells);
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // returns a structure holding information about the slot found
@@ -155,6 +172,8 @@ int32_t llama_get_kv_cache_token_count(const struct llama_kv_cache & kv);
 
 int32_t llama_get_kv_cache_used_cells(const struct llama_kv_cache & kv);
 
+size_t llama_get_kv_cache_size_max(const struct llama_kv_cache & kv);
+
 bool llama_kv_cache_can_shift(const struct llama_kv_cache & kv);
 
 //
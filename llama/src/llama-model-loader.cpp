@@ -3,9 +3,15 @@
 #include "ggml.h"
 
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstring>
+#include <functional>
 #include <future>
+#include <mutex>
+#include <thread>
 
 const char * llama_file_version_name(llama_fver version) {
     switch (version) {
@@ -706,6 +712,85 @@ struct ggml_tensor * llama_model_loader::create_tensor_as_view(struct ggml_conte
     return tensor;
 }
 
+// runs fn(i) for the items [0, n_items) on n_threads new threads, items are claimed in order so reads stay
+// roughly sequential. The calling thread polls tick() meanwhile, returning false stops claiming new items.
+// The first exception of a worker stops the others and is rethrown here.
+static bool llama_parallel_for(int n_threads, size_t n_items, const std::function<void(size_t)> & fn, const std::function<bool()> & tick) {
+    std::atomic<size_t> next{0};
+    std::atomic<bool>   stop{false};
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::exception_ptr      error;
+    int                     n_running = n_threads;
+
+    auto worker = [&]() {
+        try {
+            for (size_t i = next++; i < n_items && !stop.load(std::memory_order_relaxed); i = next++) {
+                fn(i);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            stop = true;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        n_running--;
+        cv.notify_all();
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads);
+    for (int i = 0; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+
+    bool ok = true;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (n_running > 0) {
+            cv.wait_for(lock, std::chrono::milliseconds(20));
+            if (ok && tick) {
+                lock.unlock();
+                ok = tick();
+                lock.lock();
+                if (!ok) {
+                    stop = true;
+                }
+            }
+        }
+    }
+
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    return ok;
+}
+
+// fault the pages of a mapping in from several threads, a single MAP_POPULATE is bound by one core
+static void llama_touch_pages(const void * addr, size_t size, int n_threads) {
+    constexpr size_t chunk_size = 16*1024*1024;
+    constexpr size_t page_size  = 4096; // touching more often than once per page is harmless
+
+    const size_t n_chunks = (size + chunk_size - 1) / chunk_size;
+
+    llama_parallel_for(n_threads, n_chunks, [&](size_t i) {
+        const volatile uint8_t * data = (const volatile uint8_t *) addr;
+        const size_t last = std::min(size, (i + 1)*chunk_size);
+        for (size_t offs = i*chunk_size; offs < last; offs += page_size) {
+            (void) data[offs];
+        }
+    }, nullptr);
+}
+
 void llama_model_loader::done_getting_tensors() const {
     if (n_created != n_tensors) {
         throw std::runtime_error(format("%s: wrong number of tensors; expected %d, got %d", __func__, n_tensors, n_created));
@@ -719,7 +804,13 @@ void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps
         for (const auto & file : files) {
             auto * reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
             auto * is_numa_fn = (decltype(ggml_is_numa) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_is_numa");
-            std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), prefetch ? -1 : 0, is_numa_fn()));
+            const bool numa = is_numa_fn();
+            // several threads read the file ahead by touching the pages instead of populating the mapping on this one
+            const bool touch = prefetch && !numa && n_threads > 1;
+            std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), prefetch && !touch ? -1 : 0, numa));
+            if (touch) {
+                llama_touch_pages(mapping->addr(), mapping->size(), n_threads);
+            }
             mmaps_used.emplace_back(mapping->size(), 0);
             if (mlock_mmaps) {
                 std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
@@ -787,6 +878,14 @@ bool llama_model_loader::load_all_data(
     std::vector<no_init<uint8_t>> read_buf;
     std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
+    // tensors in host memory that are read in parallel after the others
+    struct deferred_read {
+        ggml_tensor * tensor;
+        const llama_file * file;
+        size_t offs;
+    };
+    std::vector<deferred_read> deferred;
+
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
     // NVMe raid configurations might require more / larger buffers.
     constexpr size_t n_buffers = 4;
@@ -921,6 +1020,10 @@ bool llama_model_loader::load_all_data(
             }
         } else {
             const auto & file = files.at(weight->idx);
+            if (ggml_backend_buffer_is_host(cur->buffer) && n_threads > 1) {
+                deferred.push_back({cur, file.get(), weight->offs});
+                continue;
+            }
             if (ggml_backend_buffer_is_host(cur->buffer)) {
                 file->seek(weight->offs, SEEK_SET);
                 file->read_raw(cur->data, n_size);
@@ -973,8 +1076,57 @@ bool llama_model_loader::load_all_data(
     }
     ggml_backend_free(upload_backend);
 
+    std::vector<ggml_tensor *> invalid;
+    if (!deferred.empty()) {
+        // large reads at absolute offsets, the last chunk of a tensor validates it while the others keep reading
+        constexpr size_t chunk_size = 8*1024*1024;
+
+        struct read_chunk {
+            size_t read;
+            size_t offs;
+            size_t size;
+        };
+        std::vector<read_chunk> chunks;
+        std::unique_ptr<std::atomic<int>[]> chunks_left(new std::atomic<int>[deferred.size()]);
+        for (size_t i = 0; i < deferred.size(); ++i) {
+            const size_t n_size = ggml_nbytes(deferred[i].tensor);
+            int n_chunks = 0;
+            for (size_t offs = 0; offs < n_size; offs += chunk_size, ++n_chunks) {
+                chunks.push_back({i, offs, std::min(chunk_size, n_size - offs)});
+            }
+            chunks_left[i] = n_chunks;
+        }
+
+        std::atomic<size_t> size_read{0};
+        std::mutex invalid_mutex;
+
+        const bool ok = llama_parallel_for(std::min<int>(n_threads, chunks.size()), chunks.size(), [&](size_t i) {
+            const auto & chunk = chunks[i];
+            const auto & read  = deferred[chunk.read];
+            read.file->read_raw_at((uint8_t *) read.tensor->data + chunk.offs, chunk.size, read.offs + chunk.offs);
+            size_read += chunk.size;
+
+            if (--chunks_left[chunk.read] == 0 && check_tensors &&
+                !ggml_validate_row_data(read.tensor->type, read.tensor->data, ggml_nbytes(read.tensor))) {
+                std::lock_guard<std::mutex> lock(invalid_mutex);
+                invalid.push_back(read.tensor);
+            }
+        }, [&]() {
+            return !progress_callback || progress_callback((float) (size_done + size_read) / size_data, progress_callback_user_data);
+        });
+        if (!ok) {
+            return false;
+        }
+
+        size_done += size_read;
+    }
+
     // check validation results
     bool validation_failed = false;
+    for (auto * tensor : invalid) {
+        LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(tensor));
+        validation_failed = true;
+    }
     for (auto & future : validation_result) {
         auto result = future.get();
         if (!result.second) {
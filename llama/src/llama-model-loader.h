@@ -71,6 +71,9 @@ struct llama_model_loader {
     bool use_mmap = false;
     bool check_tensors;
 
+    // with more than one, tensor data is read and mapped pages are touched in parallel
+    int n_threads = 1;
+
     llama_files files;
     llama_ftype ftype;
     llama_fver  fver;
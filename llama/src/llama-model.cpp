@@ -1956,6 +1956,7 @@ struct llama_model_params llama_model_default_params() {
         /*.n_gpu_layers                =*/ 0,
         /*.split_mode                  =*/ LLAMA_SPLIT_MODE_LAYER,
         /*.main_gpu                    =*/ 0,
+        /*.n_threads_load              =*/ 1,
         /*.tensor_split                =*/ nullptr,
         /*.rpc_servers                 =*/ nullptr,
         /*.progress_callback           =*/ nullptr,
@@ -1965,6 +1966,8 @@ struct llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_prefetch                =*/ true,
+        /*.numa_place                  =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -2136,6 +2139,14 @@ uint64_t llama_model_n_params(const struct llama_model * model) {
     return model->n_elements;
 }
 
+int32_t llama_model_numa_layout(const struct llama_model * model, size_t * node_bytes, int32_t n_max) {
+    const int32_t n_nodes = (int32_t) model->numa_node_bytes.size();
+    for (int32_t i = 0; i < n_nodes && i < n_max; ++i) {
+        node_bytes[i] = model->numa_node_bytes[i];
+    }
+    return n_nodes;
+}
+
 bool llama_model_has_encoder(const struct llama_model * model) {
     switch (model->arch) {
         case LLM_ARCH_T5:        return true;
@@ -352,6 +352,9 @@ struct llama_model {
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
 
+    // bytes of weights bound to each NUMA node, empty when they were not placed
+    std::vector<size_t> numa_node_bytes;
+
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
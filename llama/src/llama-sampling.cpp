@@ -225,6 +225,14 @@ static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
     }
 }
 
+// scratch buffers of the top-k bucket sort, kept per thread so repeated sampling does not allocate
+struct llama_sampler_top_k_scratch {
+    std::vector<int>                bucket_idx;
+    std::vector<int>                histo;
+    std::vector<llama_token_data>   tmp_tokens;
+    std::vector<llama_token_data *> bucket_ptrs;
+};
+
 static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k) {
     // TODO: move bucket sort to separate function so that top_p/typical/softmax first is equally fast
     // if (k >= (int32_t)cur_p->size) {
@@ -251,8 +259,13 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
             constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
             constexpr float bucket_inter = -bucket_low * bucket_scale;
 
-            std::vector<int> bucket_idx(cur_p->size);
-            std::vector<int> histo(nbuckets, 0);
+            static thread_local llama_sampler_top_k_scratch scratch;
+
+            auto & bucket_idx = scratch.bucket_idx;
+            auto & histo      = scratch.histo;
+
+            bucket_idx.resize(cur_p->size);
+            histo.assign(nbuckets, 0);
 
             for (int i = 0; i < (int)cur_p->size; ++i) {
                 const float val = cur_p->data[i].logit;
@@ -269,10 +282,11 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
                     break;
                 }
             }
-            std::vector<llama_token_data> tmp_tokens(nhave);
+            auto & tmp_tokens = scratch.tmp_tokens;
+            tmp_tokens.resize(nhave);
             auto * ptr = tmp_tokens.data();
-            std::vector<llama_token_data*> bucket_ptrs;
-            bucket_ptrs.reserve(nbuckets - ib);
+            auto & bucket_ptrs = scratch.bucket_ptrs;
+            bucket_ptrs.clear();
             for (int j = nbuckets - 1; j >= ib; --j) {
                 bucket_ptrs.push_back(ptr);
                 ptr += histo[j];
@@ -368,16 +382,65 @@ void llama_sampler_free(struct llama_sampler * smpl) {
     delete smpl;
 }
 
+// index of the first maximum, independent lanes let the compiler vectorize the reduction
+static int32_t llama_sampler_argmax(const float * x, int32_t n) {
+    constexpr int nlanes = 8;
+
+    float lane_max[nlanes];
+    for (int l = 0; l < nlanes; ++l) {
+        lane_max[l] = -INFINITY;
+    }
+
+    int32_t i = 0;
+    for (; i + nlanes <= n; i += nlanes) {
+        for (int l = 0; l < nlanes; ++l) {
+            lane_max[l] = x[i + l] > lane_max[l] ? x[i + l] : lane_max[l];
+        }
+    }
+
+    float max = -INFINITY;
+    for (int l = 0; l < nlanes; ++l) {
+        max = lane_max[l] > max ? lane_max[l] : max;
+    }
+    for (; i < n; ++i) {
+        max = x[i] > max ? x[i] : max;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (x[i] == max) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static bool llama_sampler_is_greedy(const struct llama_sampler * smpl);
+static llama_sampler_chain * llama_sampler_as_chain(struct llama_sampler * smpl);
+
 llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
     const auto * logits = llama_get_logits_ith(ctx, idx);
 
     const int n_vocab = llama_n_vocab(llama_get_model(ctx));
 
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
+    // greedy never needs the candidates array, pick the maximum straight from the logits
+    if (llama_sampler_is_greedy(smpl)) {
+        const llama_token token = llama_sampler_argmax(logits, n_vocab);
+
+        llama_sampler_accept(smpl, token);
+
+        return token;
+    }
+
+    // chains own their candidates buffer, other samplers use a per thread one
+    static thread_local std::vector<llama_token_data> cur_local;
+
+    auto * chain = llama_sampler_as_chain(smpl);
+    auto & cur   = chain ? chain->cur : cur_local;
+
+    cur.resize(n_vocab);
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
     }
 
     llama_token_data_array cur_p = {
@@ -474,6 +537,7 @@ struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_param
         /* .ctx   = */ new llama_sampler_chain {
             /* .params      = */ params,
             /* .samplers    = */ {},
+            /* .cur         = */ {},
             /* .t_sample_us = */ 0,
             /* .n_sample    = */ 0,
         },
@@ -549,6 +613,24 @@ struct llama_sampler * llama_sampler_init_greedy() {
     };
 }
 
+static llama_sampler_chain * llama_sampler_as_chain(struct llama_sampler * smpl) {
+    return smpl->iface == &llama_sampler_chain_i ? (llama_sampler_chain *) smpl->ctx : nullptr;
+}
+
+// a greedy sampler, or a chain with nothing but a greedy sampler in it
+static bool llama_sampler_is_greedy(const struct llama_sampler * smpl) {
+    if (smpl->iface == &llama_sampler_greedy_i) {
+        return true;
+    }
+
+    if (smpl->iface == &llama_sampler_chain_i) {
+        const auto * chain = (const llama_sampler_chain *) smpl->ctx;
+        return chain->samplers.size() == 1 && chain->samplers[0]->iface == &llama_sampler_greedy_i;
+    }
+
+    return false;
+}
+
 // dist
 
 struct llama_sampler_dist {
@@ -1491,6 +1573,11 @@ struct llama_sampler * llama_sampler_init_grammar_impl(const struct llama_vocab
             /* .grammar_root = */ grammar_root,
             /* .grammar      = */ llama_grammar_init_impl(&vocab, grammar_str, grammar_root),
         };
+
+        if (ctx->grammar == nullptr) {
+            delete ctx;
+            return nullptr;
+        }
     } else {
         *ctx = {
             /* .vocab        = */ &vocab,
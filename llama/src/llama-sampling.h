@@ -14,6 +14,9 @@ struct llama_sampler_chain {
 
     std::vector<struct llama_sampler *> samplers;
 
+    // candidates buffer reused by llama_sampler_sample, sized to n_vocab on first use
+    std::vector<llama_token_data> cur;
+
     // timing
 
     mutable int64_t t_sample_us;
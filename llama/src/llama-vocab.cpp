@@ -11,6 +11,8 @@
 #include <cstdarg>
 #include <cstring>
 #include <forward_list>
+#include <list>
+#include <mutex>
 #include <queue>
 #include <sstream>
 
@@ -347,7 +349,7 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_vocab::id merged;
     int rank;
     size_t size;
 };
@@ -475,9 +477,121 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        build_merges(vocab);
+    }
+
+    // merge rank and resulting token of a pair of tokens
+    struct merge {
+        uint64_t        key; // left id << 32 | right id, EMPTY for a free slot
+        int             rank;
+        llama_vocab::id merged;
+    };
+
+    static constexpr uint64_t EMPTY = UINT64_MAX;
+
+    static uint64_t merge_key(llama_vocab::id left, llama_vocab::id right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
+
+    // returns nullptr when the pair does not merge
+    const merge * find_merge(llama_vocab::id left, llama_vocab::id right) const {
+        const uint64_t key = merge_key(left, right);
+        for (size_t i = (key * 0x9E3779B97F4A7C15ull) >> merges_shift; ; i = (i + 1) & (merges.size() - 1)) {
+            if (merges[i].key == key) {
+                return &merges[i];
+            }
+            if (merges[i].key == EMPTY) {
+                return nullptr;
+            }
+        }
+    }
+
+    // words already merged, shared by all sessions and sharded so parallel tokenize calls rarely contend
+    static constexpr size_t WORD_CACHE_SHARDS   = 16;
+    static constexpr size_t WORD_CACHE_CAPACITY = 4096; // words per shard
+    static constexpr size_t WORD_CACHE_MAX_LEN  = 64;   // longer words are rare enough to not be worth it
+
+    bool word_cache_get(const std::string & word, std::vector<llama_vocab::id> & output) const {
+        auto & shard = word_cache[std::hash<std::string>()(word) % WORD_CACHE_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        const auto it = shard.index.find(word);
+        if (it == shard.index.end()) {
+            return false;
+        }
+
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        output.insert(output.end(), it->second->second.begin(), it->second->second.end());
+        return true;
+    }
+
+    void word_cache_put(const std::string & word, const llama_vocab::id * tokens, size_t n_tokens) const {
+        auto & shard = word_cache[std::hash<std::string>()(word) % WORD_CACHE_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.index.find(word) != shard.index.end()) {
+            return;
+        }
+
+        if (shard.lru.size() >= WORD_CACHE_CAPACITY) {
+            shard.index.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+
+        shard.lru.emplace_front(word, std::vector<llama_vocab::id>(tokens, tokens + n_tokens));
+        shard.index.emplace(word, shard.lru.begin());
     }
 
     std::vector<std::string> regex_exprs;
+
+    // open addressing table of all merges, only used when every merge is made of tokens,
+    // otherwise the string keyed vocab.bpe_ranks is searched as before
+    std::vector<merge> merges;
+    int                merges_shift = 64;
+    bool               merges_by_id = false;
+
+private:
+    void build_merges(const llama_vocab & vocab) {
+        size_t n_slots = 16;
+        while (n_slots < vocab.bpe_ranks.size() * 2) {
+            n_slots *= 2;
+        }
+
+        merges.assign(n_slots, { EMPTY, 0, LLAMA_TOKEN_NULL });
+        merges_shift = 64;
+        for (size_t n = n_slots; n > 1; n >>= 1) {
+            merges_shift--;
+        }
+
+        for (const auto & it : vocab.bpe_ranks) {
+            const auto left   = vocab.token_to_id.find(it.first.first);
+            const auto right  = vocab.token_to_id.find(it.first.second);
+            if (left == vocab.token_to_id.end() || right == vocab.token_to_id.end()) {
+                merges.clear();
+                return;
+            }
+
+            const auto merged = vocab.token_to_id.find(it.first.first + it.first.second);
+            const uint64_t key = merge_key(left->second, right->second);
+
+            size_t i = (key * 0x9E3779B97F4A7C15ull) >> merges_shift;
+            while (merges[i].key != EMPTY && merges[i].key != key) {
+                i = (i + 1) & (n_slots - 1);
+            }
+            merges[i] = { key, it.second, merged == vocab.token_to_id.end() ? LLAMA_TOKEN_NULL : merged->second };
+        }
+
+        merges_by_id = true;
+    }
+
+    struct word_cache_shard {
+        std::mutex mutex;
+        std::list<std::pair<std::string, std::vector<llama_vocab::id>>> lru;
+        std::unordered_map<std::string, std::list<std::pair<std::string, std::vector<llama_vocab::id>>>::iterator> index;
+    };
+
+    mutable word_cache_shard word_cache[WORD_CACHE_SHARDS];
 };
 
 struct llm_tokenizer_bpe_session {
@@ -522,132 +636,154 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, bpe_tokenizer->regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            const bool cacheable = word.size() <= llm_tokenizer_bpe::WORD_CACHE_MAX_LEN;
+            if (cacheable && bpe_tokenizer->word_cache_get(word, output)) {
+                continue;
+            }
 
-            int index = 0;
-            size_t offset = 0;
+            const size_t n_before = output.size();
+            tokenize_word(word, output);
 
-            if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+            if (cacheable) {
+                bpe_tokenizer->word_cache_put(word, output.data() + n_before, output.size() - n_before);
             }
+        }
+    }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+private:
+    void tokenize_word(const std::string & word, std::vector<llama_vocab::id> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        symbol_ids.clear();
+
+        size_t offset = 0;
+
+        if (vocab.tokenizer_ignore_merges) {
+            const auto token = vocab.token_to_id.find(word);
+            if (token != vocab.token_to_id.end()) {
+                output.push_back(token->second);
+                return;
             }
+        }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        int index = 0;
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+            if (bpe_tokenizer->merges_by_id) {
+                const auto token = vocab.token_to_id.find(std::string(sym.text, sym.n));
+                symbol_ids.push_back(token == vocab.token_to_id.end() ? LLAMA_TOKEN_NULL : token->second);
+            }
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            // the left symbol only grows by taking in the right one, so a changed size means the
+            // right symbol grew since the bigram was queued
+            if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.n + right_symbol.n != bigram.size) {
+                continue;  // Skip this bigram if it's outdated
+            }
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            if (bpe_tokenizer->merges_by_id) {
+                symbol_ids[bigram.left] = bigram.merged;
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
+
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
         }
 
-        symbols = symbols_final;
+        // symbols keep their order, the merged ones are empty
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+            if (bpe_tokenizer->merges_by_id && symbol_ids[i] != LLAMA_TOKEN_NULL) {
+                output.push_back(symbol_ids[i]);
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.token_to_id.find(str);
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte != vocab.token_to_id.end()) {
-                            output.push_back(token_multibyte->second);
-                        }
+            if (token == vocab.token_to_id.end()) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.token_to_id.find(byte_str);
+                    if (token_multibyte != vocab.token_to_id.end()) {
+                        output.push_back(token_multibyte->second);
                     }
-                } else {
-                    output.push_back((*token).second);
                 }
+            } else {
+                output.push_back((*token).second);
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
-        int rank_found = -1;
-
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
-
-        if (rank_found < 0) {
-            return;
-        }
 
         llm_bigram_bpe bigram;
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.size  = symbols[left].n + symbols[right].n;
+
+        if (bpe_tokenizer->merges_by_id) {
+            if (symbol_ids[left] == LLAMA_TOKEN_NULL || symbol_ids[right] == LLAMA_TOKEN_NULL) {
+                return;
+            }
+
+            const auto * merge = bpe_tokenizer->find_merge(symbol_ids[left], symbol_ids[right]);
+            if (merge == nullptr) {
+                return;
+            }
+
+            bigram.rank   = merge->rank;
+            bigram.merged = merge->merged;
+        } else {
+            std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
+            std::string right_token = std::string(symbols[right].text, symbols[right].n);
+
+            const int rank_found = vocab.find_bpe_rank(left_token, right_token);
+            if (rank_found < 0) {
+                return;
+            }
+
+            bigram.rank   = rank_found;
+            bigram.merged = LLAMA_TOKEN_NULL;
+        }
 
         work_queue.push(bigram);
     }
@@ -655,9 +791,9 @@ private:
     const llama_vocab & vocab;
     const llm_tokenizer_bpe * bpe_tokenizer;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
-    llm_bigram_bpe::queue work_queue;
+    std::vector<llm_symbol>      symbols;
+    std::vector<llama_vocab::id> symbol_ids; // token of each symbol when merging by id
+    llm_bigram_bpe::queue        work_queue;
 };
 
 //
@@ -269,6 +269,41 @@ static llama_model::buft_list_t make_gpu_buft_list(ggml_backend_dev_t dev, enum
     return buft_list;
 }
 
+static int llama_numa_n_nodes() {
+    auto * dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    auto * reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+    auto * n_nodes_fn = reg ? (decltype(ggml_numa_n_nodes) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_numa_n_nodes") : nullptr;
+    return n_nodes_fn ? n_nodes_fn() : 0;
+}
+
+// binds the rows of the weights in plain CPU buffers to the node whose threads multiply them
+// repacked buffer types keep their own layout and are left alone
+static void llama_numa_place_weights(llama_model & model) {
+    const int n_nodes = llama_numa_n_nodes();
+    if (n_nodes == 0) {
+        return;
+    }
+
+    auto * reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+    auto * place_tensor_fn = (decltype(ggml_numa_place_tensor) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_numa_place_tensor");
+    if (!place_tensor_fn) {
+        return;
+    }
+
+    model.numa_node_bytes.assign(n_nodes, 0);
+    for (auto & ctx : model.ctxs) {
+        for (auto * cur = ggml_get_first_tensor(ctx.get()); cur != NULL; cur = ggml_get_next_tensor(ctx.get(), cur)) {
+            if (cur->buffer && ggml_backend_buffer_get_type(cur->buffer) == ggml_backend_cpu_buffer_type()) {
+                place_tensor_fn(cur, model.numa_node_bytes.data());
+            }
+        }
+    }
+
+    for (int n = 0; n < n_nodes; ++n) {
+        LLAMA_LOG_INFO("%s: NUMA node %d holds %8.2f MiB of weights\n", __func__, n, model.numa_node_bytes[n] / 1024.0 / 1024.0);
+    }
+}
+
 // Returns false if cancelled by progress_callback
 static bool llm_load_tensors(
         llama_model_loader & ml,
@@ -278,6 +313,8 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        bool use_prefetch,
+        bool numa_place,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     auto & hparams = model.hparams;
@@ -2300,7 +2337,7 @@ static bool llm_load_tensors(
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &model.mlock_mmaps : nullptr);
+    ml.init_mappings(use_prefetch, use_mlock ? &model.mlock_mmaps : nullptr);
     model.mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -2403,6 +2440,11 @@ static bool llm_load_tensors(
         LLAMA_LOG_INFO("%s: %12s model buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf.get()), ggml_backend_buffer_get_size(buf.get()) / 1024.0 / 1024.0);
     }
 
+    // bind the rows each NUMA node multiplies to its memory before they are read
+    if (numa_place) {
+        llama_numa_place_weights(model);
+    }
+
     // populate tensors_by_name
     for (auto & ctx : model.ctxs) {
         for (auto * cur = ggml_get_first_tensor(ctx.get()); cur != NULL; cur = ggml_get_next_tensor(ctx.get(), cur)) {
@@ -2433,7 +2475,14 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
     model.t_start_us = ggml_time_us();
 
     try {
+        // placement needs memory of our own, a shared file mapping stays wherever the page cache put it
+        if (params.numa_place && params.use_mmap && llama_numa_n_nodes() > 0) {
+            LLAMA_LOG_INFO("%s: placing weights on %d NUMA nodes, reading them instead of mapping\n", __func__, llama_numa_n_nodes());
+            params.use_mmap = false;
+        }
+
         llama_model_loader ml(fname, params.use_mmap, params.check_tensors, params.kv_overrides);
+        ml.n_threads = params.n_threads_load;
 
         model.hparams.vocab_only = params.vocab_only;
 
@@ -2467,7 +2516,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
         }
 
         if (!llm_load_tensors(
-            ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
+            ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock, params.use_prefetch, params.numa_place,
             params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
@@ -2554,13 +2603,12 @@ static void llm_build_kv_store(
                     int32_t   kv_head,
          const llm_build_cb & cb,
                     int64_t   il) {
-    const int64_t n_ctx = cparams.n_ctx;
+    // the cache can be smaller than the context while it grows
+    const int64_t kv_size = kv.size;
 
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-    GGML_ASSERT(kv.size == n_ctx);
-
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
     cb(k_cache_view, "k_cache_view", il);
 
@@ -2576,7 +2624,7 @@ static void llm_build_kv_store(
     } else {
         // note: the V cache is transposed when not using flash attention
         v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
-                (  n_ctx)*ggml_element_size(kv.v_l[il]),
+                (kv_size)*ggml_element_size(kv.v_l[il]),
                 (kv_head)*ggml_element_size(kv.v_l[il]));
 
         v_cur = ggml_transpose(ctx, v_cur);
@@ -2922,7 +2970,7 @@ static struct ggml_tensor * llm_build_kqv(
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
-    const int64_t n_ctx         = cparams.n_ctx;
+    const int64_t kv_size       = kv.size;
     const int64_t n_head        = hparams.n_head(il);
     const int64_t n_head_kv     = hparams.n_head_kv(il);
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
@@ -2945,7 +2993,7 @@ static struct ggml_tensor * llm_build_kqv(
 
     if (cparams.flash_attn) {
         GGML_UNUSED(model);
-        GGML_UNUSED(n_ctx);
+        GGML_UNUSED(kv_size);
 
         // split cached v into n_head heads (not transposed)
         struct ggml_tensor * v =
@@ -2990,14 +3038,12 @@ static struct ggml_tensor * llm_build_kqv(
         kq = ggml_soft_max_ext(ctx, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
         cb(kq, "kq_soft_max_ext", il);
 
-        GGML_ASSERT(kv.size == n_ctx);
-
         // split cached v into n_head heads
         struct ggml_tensor * v =
             ggml_view_3d(ctx, kv.v_l[il],
                     n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[il])*n_ctx,
-                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
+                    ggml_element_size(kv.v_l[il])*kv_size,
+                    ggml_element_size(kv.v_l[il])*kv_size*n_embd_head_v,
                     0);
         cb(v, "v", il);
 
@@ -3525,9 +3571,9 @@ struct llm_build_context {
     struct ggml_cgraph * build_k_shift() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
-        GGML_ASSERT(kv_self.size == n_ctx);
+        const int64_t kv_size = kv_self.size;
 
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
+        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, kv_size);
         cb(lctx.inp_K_shift, "K_shift", -1);
         ggml_set_input(lctx.inp_K_shift);
 
@@ -3537,7 +3583,7 @@ struct llm_build_context {
             struct ggml_tensor * rope_factors = build_rope_factors(il);
             struct ggml_tensor * k =
                 ggml_view_3d(ctx0, kv_self.k_l[il],
-                    n_embd_head_k, n_head_kv, n_ctx,
+                    n_embd_head_k, n_head_kv, kv_size,
                     ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
                     ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
                     0);
@@ -9137,8 +9183,8 @@ struct llm_build_context {
                 struct ggml_tensor * v =
                     ggml_view_3d(ctx0, kv_self.v_l[il],
                             n_kv, n_embd_head_v, n_head_kv,
-                            ggml_element_size(kv_self.v_l[il])*n_ctx,
-                            ggml_element_size(kv_self.v_l[il])*n_ctx*n_embd_head_v,
+                            ggml_element_size(kv_self.v_l[il])*kv_self.size,
+                            ggml_element_size(kv_self.v_l[il])*kv_self.size*n_embd_head_v,
                             0);
                 cb(v, "v", il);
 
@@ -10517,6 +10563,97 @@ static enum ggml_status llama_graph_compute(
 // return positive int on warning
 // return negative int on error
 //
+// decode graph reuse
+//
+// the graph of a decode only depends on the ubatch shape, the number of attended cells and the cache tensors,
+// the position of the new cells in the cache enters through the offsets of the K/V store views
+
+static bool llama_graph_cache_enabled(const llama_context & lctx) {
+    return !lctx.kv_self.recurrent &&
+           !llama_model_has_encoder(&lctx.model) &&
+           lctx.cparams.cb_eval == nullptr &&
+           ggml_backend_sched_get_n_copies(lctx.sched.get()) == 1;
+}
+
+static bool llama_graph_cache_match(const llama_context & lctx, const llama_ubatch & ubatch) {
+    const auto & gc = lctx.graph_cache;
+
+    return gc.gf != nullptr &&
+           gc.n_tokens     == ubatch.n_tokens &&
+           gc.n_seq_tokens == ubatch.n_seq_tokens &&
+           gc.n_seqs       == ubatch.n_seqs &&
+           gc.equal_seqs   == ubatch.equal_seqs &&
+           gc.token        == (ubatch.token != nullptr) &&
+           gc.n_outputs    == lctx.n_outputs &&
+           gc.n_kv         == lctx.kv_self.n &&
+           gc.n_realloc    == lctx.kv_self.n_realloc &&
+           gc.embeddings   == lctx.cparams.embeddings &&
+           gc.causal_attn  == lctx.cparams.causal_attn;
+}
+
+static void llama_graph_cache_store(llama_context & lctx, const llama_ubatch & ubatch, ggml_cgraph * gf) {
+    auto & gc = lctx.graph_cache;
+    const auto & kv_self = lctx.kv_self;
+
+    gc.gf = nullptr;
+    gc.kv_stores.clear();
+
+    if (!llama_graph_cache_enabled(lctx)) {
+        return;
+    }
+
+    // bytes per cell of every cache tensor, the same strides llm_build_kv_store uses
+    std::unordered_map<const ggml_tensor *, size_t> cell_size;
+    for (size_t il = 0; il < kv_self.k_l.size(); ++il) {
+        cell_size[kv_self.k_l[il]] = ggml_nbytes(kv_self.k_l[il]) / kv_self.size;
+        cell_size[kv_self.v_l[il]] = kv_self.v_trans ? ggml_type_size(kv_self.v_l[il]->type) : ggml_nbytes(kv_self.v_l[il]) / kv_self.size;
+    }
+
+    for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+        ggml_tensor * node = ggml_graph_node(gf, i);
+        if (node->op != GGML_OP_CPY || node->view_src == nullptr) {
+            continue;
+        }
+
+        const auto it = cell_size.find(node->view_src);
+        if (it == cell_size.end()) {
+            continue;
+        }
+
+        // the copy is a view of the destination view, both point at the cells being written
+        if (node->view_offs != it->second*kv_self.head || node->src[1]->view_offs != node->view_offs) {
+            gc.kv_stores.clear();
+            return;
+        }
+
+        gc.kv_stores.emplace_back(node, it->second);
+    }
+
+    gc.gf           = gf;
+    gc.n_tokens     = ubatch.n_tokens;
+    gc.n_seq_tokens = ubatch.n_seq_tokens;
+    gc.n_seqs       = ubatch.n_seqs;
+    gc.equal_seqs   = ubatch.equal_seqs;
+    gc.token        = ubatch.token != nullptr;
+    gc.n_outputs    = lctx.n_outputs;
+    gc.n_kv         = kv_self.n;
+    gc.n_realloc    = kv_self.n_realloc;
+    gc.embeddings   = lctx.cparams.embeddings;
+    gc.causal_attn  = lctx.cparams.causal_attn;
+}
+
+// move the K/V stores of the cached graph to the current cache head
+static void llama_graph_cache_rebind(llama_context & lctx) {
+    const size_t head = lctx.kv_self.head;
+
+    for (auto & store : lctx.graph_cache.kv_stores) {
+        for (ggml_tensor * t : { store.first, store.first->src[1] }) {
+            t->view_offs = store.second*head;
+            t->data      = (char *) t->view_src->data + t->view_offs;
+        }
+    }
+}
+
 static int llama_decode_internal(
          llama_context & lctx,
            llama_batch   inp_batch) {
@@ -10662,10 +10799,24 @@ static int llama_decode_internal(
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched.get());
-        ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+        ggml_cgraph * gf = nullptr;
+
+        if (llama_graph_cache_match(lctx, ubatch)) {
+            // the graph is still allocated in the scheduler, only the cache stores move
+            gf = lctx.graph_cache.gf;
+            llama_graph_cache_rebind(lctx);
+        } else {
+            ggml_backend_sched_reset(lctx.sched.get());
+            ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+
+            gf = llama_build_graph(lctx, ubatch, false);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
+            // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+            ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+
+            llama_graph_cache_store(lctx, ubatch, gf);
+        }
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = ggml_graph_node(gf, -1);
@@ -10690,14 +10841,11 @@ static int llama_decode_internal(
             GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
         }
 
-        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
-
-        ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
-
         llama_set_inputs(lctx, ubatch);
 
         const auto compute_status = llama_graph_compute(lctx, gf, n_threads, threadpool);
         if (compute_status != GGML_STATUS_SUCCESS) {
+            lctx.graph_cache.gf = nullptr;
             kv_slot_restorer.restore(kv_self);
             switch (compute_status) {
                 case GGML_STATUS_ABORTED:
@@ -10838,7 +10986,10 @@ static int llama_decode_internal(
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched.get());
+    // A cached graph keeps its allocation, the next decode of the same shape reuses it.
+    if (!lctx.graph_cache.gf) {
+        ggml_backend_sched_reset(lctx.sched.get());
+    }
 
     return 0;
 }
@@ -10917,6 +11068,8 @@ static int llama_encode_internal(
 
     GGML_ASSERT(n_threads > 0);
 
+    lctx.graph_cache.gf = nullptr;
+
     ggml_backend_sched_reset(lctx.sched.get());
     ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
@@ -11257,6 +11410,11 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
+    // the shift, defrag and reserve graphs reuse the compute buffers of the cached decode graph
+    if (lctx.kv_self.has_shift || lctx.kv_self.do_defrag) {
+        lctx.graph_cache.gf = nullptr;
+    }
+
     if (lctx.kv_self.has_shift) {
         if (!llama_kv_cache_can_shift(&lctx)) {
             GGML_ABORT("The current context does not support K-shift");
@@ -11325,6 +11483,7 @@ int32_t llama_lora_adapter_set(
     }
 
     ctx->lora_adapters[adapter] = scale;
+    ctx->graph_cache.gf = nullptr;
 
     return 0;
 }
@@ -11335,6 +11494,7 @@ int32_t llama_lora_adapter_remove(
     auto pos = ctx->lora_adapters.find(adapter);
     if (pos != ctx->lora_adapters.end()) {
         ctx->lora_adapters.erase(pos);
+        ctx->graph_cache.gf = nullptr;
         return 0;
     }
 
@@ -11343,6 +11503,7 @@ int32_t llama_lora_adapter_remove(
 
 void llama_lora_adapter_clear(struct llama_context * ctx) {
     ctx->lora_adapters.clear();
+    ctx->graph_cache.gf = nullptr;
 }
 
 // TODO: tmp
@@ -11353,6 +11514,7 @@ int32_t llama_control_vector_apply(
                      int32_t   n_embd,
                      int32_t   il_start,
                      int32_t   il_end) {
+    lctx->graph_cache.gf = nullptr;
     return llama_control_vector_apply(lctx->cvec, lctx->model, data, len, n_embd, il_start, il_end);
 }
 
@@ -11363,6 +11525,7 @@ int32_t llama_control_vector_apply(
 struct llama_context_params llama_context_default_params() {
     struct llama_context_params result = {
         /*.n_ctx                       =*/ 512,
+        /*.n_ctx_init                  =*/ 0,
         /*.n_batch                     =*/ 2048,
         /*.n_ubatch                    =*/ 512,
         /*.n_seq_max                   =*/ 1,
@@ -11722,8 +11885,12 @@ struct llama_context * llama_new_context_with_model(
         type_v = GGML_TYPE_F32; // required by ggml_ssm_scan for Mamba's ssm_states
     }
 
-    GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
-    GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
+    if (hparams.n_embd_head_k % ggml_blck_size(type_k) != 0 || hparams.n_embd_head_v % ggml_blck_size(type_v) != 0) {
+        LLAMA_LOG_ERROR("%s: KV cache types %s/%s need head sizes divisible by their block size, got %u/%u\n", __func__,
+                ggml_type_name(type_k), ggml_type_name(type_v), hparams.n_embd_head_k, hparams.n_embd_head_v);
+        llama_free(ctx);
+        return nullptr;
+    }
 
     if (!hparams.vocab_only) {
         // GPU backends
@@ -11774,7 +11941,7 @@ struct llama_context * llama_new_context_with_model(
 
         llama_set_abort_callback(ctx, params.abort_callback, params.abort_callback_data);
 
-        if (!llama_kv_cache_init(ctx->kv_self, ctx->model, ctx->cparams, type_k, type_v, kv_size, cparams.offload_kqv)) {
+        if (!llama_kv_cache_init(ctx->kv_self, ctx->model, ctx->cparams, type_k, type_v, kv_size, params.n_ctx_init, cparams.offload_kqv)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
@@ -11947,6 +12114,14 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
     return llama_get_kv_cache_used_cells(ctx->kv_self);
 }
 
+size_t llama_get_kv_cache_size(const struct llama_context * ctx) {
+    return ctx->kv_self.total_size();
+}
+
+size_t llama_get_kv_cache_size_max(const struct llama_context * ctx) {
+    return llama_get_kv_cache_size_max(ctx->kv_self);
+}
+
 void llama_kv_cache_clear(struct llama_context * ctx) {
     llama_kv_cache_clear(ctx->kv_self);
 }
@@ -21,15 +21,61 @@ export const SetLogLevel = (level: LogLevel): void => {
     npmLlama.SetLogLevel(level);
 }
 
+//  Loaded models are shared between calls using the same file, unreferenced ones are kept
+//  (least recently used dropped first) as long as their total size fits into this budget
+export const SetModelCacheBudget = (bytes: number): void => {
+    npmLlama.SetModelCacheBudget(bytes);
+}
+
+//  Async calls run on threads of the addon instead of the libuv threadpool, so generations never hold
+//  up fs, dns or crypto work. The pool grows up to this many threads, max(4, cpu count) by default.
+//  Returns the previous limit.
+export const SetWorkerThreads = (threads: number): number => {
+    return npmLlama.SetWorkerThreads(threads);
+}
+
+//  Sampler chain, when given replaces the default greedy (or seeded random) sampling.
+//  Stages run in order logitBias, topK, penalties, DRY, typicalP, topP, minP, XTC, temperature
+export interface SamplingOptions {
+    temperature?: number;           // <= 0 picks the most likely remaining token
+    dynatempRange?: number;
+    dynatempExponent?: number;
+    topK?: number;                  // <= 0 disables
+    topP?: number;
+    minP?: number;
+    typicalP?: number;
+    xtcProbability?: number;
+    xtcThreshold?: number;
+    penaltyLastN?: number;
+    repeatPenalty?: number;
+    frequencyPenalty?: number;
+    presencePenalty?: number;
+    dryMultiplier?: number;         // > 0 enables DRY
+    dryBase?: number;
+    dryAllowedLength?: number;
+    dryPenaltyLastN?: number;
+    drySequenceBreakers?: string[];
+    mirostat?: 0 | 1 | 2;
+    mirostatTau?: number;
+    mirostatEta?: number;
+    logitBias?: { [token: number]: number };
+}
+
+//  "auto" times a few decodes when the context gets created and picks the fastest thread count
+export type Threads = number | "auto";
+
 export interface RunInferenceOptions {
     modelPath: string;
-    prompt: string;
+    prompt: string | Int32Array;    // token ids are the complete prompt, used in place without tokenizing
     systemPrompt: string;
     maxTokens?: number;
-    threads?: number;
+    threads?: Threads;
     seed?: number;
     nCtx?: number;
     flashAttention?: boolean;
+    sampling?: SamplingOptions;
+    grammar?: string;               // GBNF, the reply has to match its root rule
+    jsonSchema?: object | boolean; // converted to a grammar natively, ignored when grammar is given
     onStream?: (text: string, done: boolean) => void;
 }
 
@@ -43,17 +89,79 @@ export const GetModelToken = (model: any, token: TokenName): string => {
     return npmLlama.GetModelToken(model, token);
 }
 
+export interface CreateThreadpoolOptions {
+    threads: number;
+    cpumask?: string | number[];    // hex mask ("0xff") or list of cpu indices
+    priority?: "normal" | "medium" | "high" | "realtime";
+    poll?: number;                  // 0 sleeps right away, 100 keeps spinning for new work
+    strictCpu?: boolean;            // pin each thread to its own cpu of the mask
+}
+
+//  Persistent threadpool that can be shared by contexts, which then take turns computing.
+//  It is freed once the handle and every context using it are gone.
+export const CreateThreadpool = (options: CreateThreadpoolOptions): any => {
+    return npmLlama.CreateThreadpool(options);
+}
+
+export interface ContextInfo {
+    nCtx: number;
+    typeK: string;
+    typeV: string;
+    kvSize: number;                 // bytes allocated by the KV cache right now
+    kvSizeMax: number;              // bytes once the KV cache holds nCtx tokens
+}
+
+export const GetContextInfo = (context: any): ContextInfo => {
+    return npmLlama.GetContextInfo(context);
+}
+
+export interface NumaNode {
+    node: number;
+    cpus: number[];
+    weightBytes: number;            // bytes of the weights bound to the memory of this node
+}
+
+export const GetNumaLayout = (model: any): NumaNode[] => {
+    return npmLlama.GetNumaLayout(model);
+}
+
 //  Async functions
 
-export const LoadModelAsync = async (modelPath: string): Promise<any> => {
-    return npmLlama.LoadModelAsync(modelPath);
+export type NumaStrategy = "disabled" | "distribute" | "isolate" | "numactl" | "mirror";
+
+export interface LoadModelOptions {
+    useMmap?: boolean;              // map the file instead of reading it, true by default
+    useMlock?: boolean;             // keep the weights resident in RAM
+    prefetch?: boolean;             // read a mapped file ahead instead of on first use, true by default
+    threads?: number;               // parallel readers of the weights, up to 4 by default
+    numa?: NumaStrategy;            // process wide, the first load setting one decides it
+    numaPlace?: boolean;            // with "distribute", bind each node's weight rows to its memory, true by default
+    onProgress?: (progress: number) => void;    // 0 - 1, always ends with 1
+}
+
+export const LoadModelAsync = async (modelPath: string, options?: LoadModelOptions): Promise<any> => {
+    return npmLlama.LoadModelAsync(modelPath, options);
 }
 
+export type PoolingType = "none" | "mean" | "cls" | "last" | "rank";
+
+export type CacheType = "f32" | "f16" | "bf16" | "q8_0" | "q5_1" | "q5_0" | "q4_1" | "q4_0" | "iq4_nl";
+
 export interface CreateContextOptions {
     model: any;
-    threads?: number;
+    threads?: Threads;              // single token decodes
+    threadsBatch?: Threads;         // prompt processing, same as threads by default
+    threadpool?: any;               // shared threadpools, override the thread counts
+    threadpoolBatch?: any;
     nCtx?: number;
     flashAttention?: boolean;
+    typeK?: CacheType;              // KV cache types, f16 by default
+    typeV?: CacheType;              // quantized types require flashAttention
+    maxSequences?: number;
+    batchSize?: number;
+    pooling?: PoolingType;
+    //  Cells the KV cache starts with, it grows on demand up to nCtx (0 allocates nCtx up front)
+    nCtxInit?: number;
 }
 
 export const CreateContextAsync = async (options: CreateContextOptions): Promise<any> => {
@@ -63,11 +171,31 @@ export const CreateContextAsync = async (options: CreateContextOptions): Promise
 export interface RunInferenceAsyncOptions {
     model: any;
     context: any;
-    prompt: string;
+    prompt: string | Int32Array;    // token ids are the complete prompt, used in place without tokenizing
     systemPrompt: string;
     maxTokens?: number;
     seed?: number;
-    onStream?: (text: string, done: boolean) => void;
+    sampling?: SamplingOptions;
+    grammar?: string;               // GBNF, the reply has to match its root rule
+    jsonSchema?: object | boolean; // converted to a grammar natively, ignored when grammar is given
+    onStream?: (text: string, done: boolean, tokens?: Int32Array) => void;
+    streamChunkTokens?: number;
+    streamIntervalUs?: number;
+    streamTokens?: boolean;
+    //  Chat handle from CreateChat, the prompt becomes the next user message and systemPrompt is ignored
+    chat?: any;
+    //  Rejects the promise and stops using the CPU within one graph node once aborted or past the timeout
+    signal?: AbortSignal;
+    timeoutMs?: number;
+    //  Guesses ahead verified in one pass, the reply stays exactly what the model alone would give
+    draft?: DraftOptions;
+}
+
+export interface DraftOptions {
+    context?: any;                  // context of a small draft model, used by one inference at a time
+    ngram?: number;                 // without a context, guesses follow the last ngram tokens seen earlier, 3 by default, at least 2
+    maxTokens?: number;             // longest guess per step, 8 by default
+    pMin?: number;                  // stop guessing below this draft probability, 0.75 by default
 }
 
 export const RunInferenceAsync = async (options: RunInferenceAsyncOptions): Promise<string> => {
@@ -82,5 +210,114 @@ export const ReleaseModelAsync = async (model: any): Promise<void> => {
     return npmLlama.ReleaseModelAsync(model);
 }
 
+//  Chat - history rendered by the chat template of the model (or the given template name or
+//  Jinja string), only the new turn gets tokenized and decoded on every RunInferenceAsync call
+
+export interface CreateChatOptions {
+    systemPrompt?: string;
+    template?: string;
+}
+
+export interface ChatMessage {
+    role: string;
+    content: string;
+}
+
+export const CreateChat = (options?: CreateChatOptions): any => {
+    return npmLlama.CreateChat(options);
+}
+
+export const GetChatHistory = (chat: any): ChatMessage[] => {
+    return npmLlama.GetChatHistory(chat);
+}
+
+//  Sessions - the KV cache of a context can be saved and restored, resolves to the number of cached tokens
+
+export const SaveSessionAsync = async (context: any, path: string): Promise<number> => {
+    return npmLlama.SaveSessionAsync(context, path);
+}
+
+export const LoadSessionAsync = async (context: any, path: string): Promise<number> => {
+    return npmLlama.LoadSessionAsync(context, path);
+}
+
+export const CreateSnapshotAsync = async (context: any): Promise<any> => {
+    return npmLlama.CreateSnapshotAsync(context);
+}
+
+export const RestoreSnapshotAsync = async (context: any, snapshot: any): Promise<number> => {
+    return npmLlama.RestoreSnapshotAsync(context, snapshot);
+}
+
+export interface TokenizeOptions {
+    addSpecial?: boolean;      /* add BOS/EOS if the model wants them, default true */
+    parseSpecial?: boolean;    /* turn special token text into special tokens, default true */
+}
+
+export interface DetokenizeOptions {
+    removeSpecial?: boolean;   /* drop leading BOS/trailing EOS if the model adds them, default false */
+    unparseSpecial?: boolean;  /* render special tokens as text, default true */
+}
+
+//  Tokenizes all inputs with the model vocab in one call, spread over the worker threads
+export const TokenizeAsync = async (model: any, inputs: string[], options?: TokenizeOptions): Promise<Int32Array[]> => {
+    return npmLlama.TokenizeAsync(model, inputs, options);
+}
+
+export const DetokenizeAsync = async (model: any, inputs: (Int32Array | number[])[], options?: DetokenizeOptions): Promise<string[]> => {
+    return npmLlama.DetokenizeAsync(model, inputs, options);
+}
+
+export interface EmbedOptions {
+    normalize?: boolean;
+}
+
+//  Returns one contiguous array with inputs.length rows of (length / inputs.length) dimensions
+export const EmbedAsync = async (context: any, inputs: string[], options?: EmbedOptions): Promise<Float32Array> => {
+    return npmLlama.EmbedAsync(context, inputs, options);
+}
+
+//  Batch engine - many concurrent prompts share one context and are decoded together
+
+export interface CreateBatchEngineOptions {
+    model: any;
+    threads?: Threads;
+    threadsBatch?: Threads;
+    nCtx?: number;
+    flashAttention?: boolean;
+    typeK?: CacheType;
+    typeV?: CacheType;
+    maxSequences?: number;
+    batchSize?: number;
+    nCtxInit?: number;
+}
+
+export const CreateBatchEngineAsync = async (options: CreateBatchEngineOptions): Promise<any> => {
+    return npmLlama.CreateBatchEngineAsync(options);
+}
+
+export interface RunBatchInferenceOptions {
+    engine: any;
+    prompt: string | Int32Array;    // token ids are the complete prompt, used in place without tokenizing
+    systemPrompt: string;
+    maxTokens?: number;
+    seed?: number;
+    sampling?: SamplingOptions;
+    grammar?: string;               // GBNF, the reply has to match its root rule
+    jsonSchema?: object | boolean; // converted to a grammar natively, ignored when grammar is given
+    onStream?: (text: string, done: boolean) => void;
+    //  Checked between engine steps, the sequence leaves the batch on the next step
+    signal?: AbortSignal;
+    timeoutMs?: number;
+}
+
+export const RunBatchInferenceAsync = async (options: RunBatchInferenceOptions): Promise<string> => {
+    return npmLlama.RunBatchInferenceAsync(options);
+}
+
+export const ReleaseBatchEngineAsync = async (engine: any): Promise<void> => {
+    return npmLlama.ReleaseBatchEngineAsync(engine);
+}
+
 //  Utility functions
 export { ChatManager, Role, downloadModel };
\ No newline at end of file
@@ -1,5 +1,31 @@
 #include <napi.h>
 #include <queue>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
+#include <set>
+#include <tuple>
+#include <memory>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "llama-cpp.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -8,7 +34,7 @@
 
 int g_logLevel = GGML_LOG_LEVEL_WARN;
 
-typedef void (*stream_callback)(const std::string &, bool, void *data);
+typedef void (*stream_callback)(const char *text, size_t length, llama_token token, bool done, void *data);
 struct stream_callback_info
 {
     stream_callback callback;
@@ -21,12 +47,19 @@ void log(ggml_log_level level, const char *text, void *data)
         printf("%s", text);
 }
 
-llama_model *loadModel(const std::string &model_path)
+//  Backends and logging are process wide, set them up only once
+void initBackend()
 {
-    ggml_backend_load_all();
-    llama_log_set(log, nullptr);
+    static std::once_flag once;
+    std::call_once(once, []()
+                   {
+        ggml_backend_load_all();
+        llama_log_set(log, nullptr); });
+}
 
-    llama_model_params model_params = llama_model_default_params();
+llama_model *loadModelFromFile(const std::string &model_path, const llama_model_params &model_params)
+{
+    initBackend();
 
     llama_model *model = llama_load_model_from_file(model_path.c_str(), model_params);
 
@@ -39,366 +72,4480 @@ llama_model *loadModel(const std::string &model_path)
     return model;
 }
 
-llama_context *createContext(llama_model *model, int n_thread = 1, int n_ctx = 0, bool flash_attn = true)
+//  Parsed grammars by model and grammar text, samplers for new requests are cloned from the cached
+//  ones (a copy of the parsed rules and stacks) instead of parsing the grammar again
+class grammar_cache
 {
-    if (!model)
+public:
+    //  Returns nullptr when the grammar does not parse
+    std::shared_ptr<llama_sampler> acquire(const llama_model *model, const std::string &grammar)
     {
-        fprintf(stderr, "Error: Invalid model handle\n");
-        return nullptr;
-    }
+        const size_t hash = std::hash<std::string>()(grammar);
 
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = n_ctx; // 0 means load from model
-    ctx_params.no_perf = true;
-    ctx_params.flash_attn = flash_attn;
-    ctx_params.n_threads = n_thread;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = find(model, hash, grammar);
+            if (it != _entries.end())
+            {
+                _entries.splice(_entries.begin(), _entries, it);
+                return it->sampler;
+            }
+        }
 
-    llama_context *ctx = llama_new_context_with_model(model, ctx_params);
-    if (!ctx)
-    {
-        fprintf(stderr, "Error: Failed to create the llama_context\n");
-        return nullptr;
-    }
+        std::shared_ptr<llama_sampler> sampler(llama_sampler_init_grammar(model, grammar.c_str(), "root"), llama_sampler_free);
+        if (!sampler)
+        {
+            return nullptr;
+        }
 
-    return ctx;
-}
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.push_front({model, hash, grammar, sampler});
+        if (_entries.size() > MAX_ENTRIES)
+        {
+            _entries.pop_back();
+        }
+        return sampler;
+    }
 
-std::string runInference(llama_model *model, llama_context *ctx, const std::string &system_prompt,
-                         const std::string &user_prompt, int max_tokens = 1024, size_t seed = LLAMA_DEFAULT_SEED, stream_callback_info *on_stream = nullptr)
-{
-    if (!model || !ctx)
+    //  Cached samplers point into the vocabulary of their model, drop them before it is freed
+    void forget(const llama_model *model)
     {
-        fprintf(stderr, "Error: Invalid model or context handle\n");
-        return "";
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.remove_if([model](const entry &e)
+                           { return e.model == model; });
     }
 
-    // Rest of existing runInference code, but remove context creation/cleanup
-    bool isFullPrompt = system_prompt.size() > 2 && system_prompt[0] == '!' && system_prompt[1] == '#';
-
-    std::string llama_format_prompt = "<|im_start|>system " + system_prompt + "<|im_end|>" +
-                                      "<|im_start|>user " + user_prompt + "<|im_end|>" +
-                                      "<|im_start|>assistant";
-
-    std::string full_prompt = isFullPrompt ? user_prompt.substr(2) : llama_format_prompt;
+private:
+    static const size_t MAX_ENTRIES = 64;
 
-    const int n_prompt = -llama_tokenize(model, full_prompt.c_str(), full_prompt.size(),
-                                         nullptr, 0, true, true);
-    std::vector<llama_token> prompt_tokens(n_prompt);
+    struct entry
+    {
+        const llama_model *model;
+        size_t hash;
+        std::string grammar;
+        std::shared_ptr<llama_sampler> sampler;
+    };
 
-    if (llama_tokenize(model, full_prompt.c_str(), full_prompt.size(),
-                       prompt_tokens.data(), prompt_tokens.size(), true, true) < 0)
+    std::list<entry>::iterator find(const llama_model *model, size_t hash, const std::string &grammar)
     {
-        fprintf(stderr, "Error: Failed to tokenize the prompt\n");
-        return "";
+        return std::find_if(_entries.begin(), _entries.end(), [&](const entry &e)
+                            { return e.model == model && e.hash == hash && e.grammar == grammar; });
     }
 
-    // Initialize sampler
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = false;
+    std::mutex _mutex;
+    std::list<entry> _entries;
+};
 
-    //  Decide on a mode of the sampler - greedy is deterministic and consistent, distributed is more creative
-    llama_sampler *smpl = llama_sampler_chain_init(sparams);
-    seed == LLAMA_DEFAULT_SEED ? llama_sampler_chain_add(smpl, llama_sampler_init_greedy()) : llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+grammar_cache g_grammars;
 
-    // Prepare initial batch
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
+//  Checking a draft model against its target compares every token text, the verdict is kept per model pair
+class vocab_match_cache
+{
+public:
+    //  -1 when the pair was not checked yet
+    int find(const llama_model *target, const llama_model *draft)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _pairs.find({target, draft});
+        return it == _pairs.end() ? -1 : it->second;
+    }
 
-    // Generate response
-    std::string generated_text;
-    int n_decode = 0;
-    llama_token new_token_id;
-    int max = n_prompt + max_tokens;
+    void store(const llama_model *target, const llama_model *draft, bool match)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pairs[{target, draft}] = match;
+    }
 
-    for (int n_pos = 0; n_pos + batch.n_tokens < max;)
+    //  A freed model's address may be reused by the next load
+    void forget(const llama_model *model)
     {
-        if (llama_decode(ctx, batch))
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto it = _pairs.begin(); it != _pairs.end();)
         {
-            fprintf(stderr, "Error: Failed to decode\n");
-            llama_sampler_free(smpl);
-            llama_free(ctx);
-            return "";
+            it = it->first.first == model || it->first.second == model ? _pairs.erase(it) : std::next(it);
         }
+    }
 
-        n_pos += batch.n_tokens;
-
-        // Sample next token
-        new_token_id = llama_sampler_sample(smpl, ctx, -1);
+private:
+    std::mutex _mutex;
+    std::map<std::pair<const llama_model *, const llama_model *>, bool> _pairs;
+};
 
-        // Check for end of generation
-        if (llama_token_is_eog(model, new_token_id))
-        {
-            break;
-        }
+vocab_match_cache g_vocab_matches;
 
-        // Convert token to text
-        char buf[128];
-        int n = llama_token_to_piece(model, new_token_id, buf, sizeof(buf), 0, true);
-        if (n < 0)
-        {
-            fprintf(stderr, "Error: Failed to convert token to piece\n");
-            llama_sampler_free(smpl);
-            llama_free(ctx);
-            return "";
-        }
+//  Thread counts picked by auto tuning, timing the decodes again for every new context would delay each creation
+class tuned_threads_cache
+{
+public:
+    //  0 when this setup was not tuned yet
+    int find(const llama_model *model, bool batch, uint32_t n_ubatch, int max_threads)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _threads.find(key{model, batch, n_ubatch, max_threads});
+        return it == _threads.end() ? 0 : it->second;
+    }
 
-        // Append to generated text
-        generated_text.append(buf, n);
+    void store(const llama_model *model, bool batch, uint32_t n_ubatch, int max_threads, int threads)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _threads[key{model, batch, n_ubatch, max_threads}] = threads;
+    }
 
-        if (on_stream != nullptr)
+    void forget(const llama_model *model)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto it = _threads.begin(); it != _threads.end();)
         {
-            on_stream->callback(std::string(buf, n), false, on_stream->data);
+            it = it->first.model == model ? _threads.erase(it) : std::next(it);
         }
-
-        // Prepare next batch
-        batch = llama_batch_get_one(&new_token_id, 1);
-        n_decode += 1;
     }
 
-    //  Finish the generation
-    if (on_stream != nullptr)
+private:
+    struct key
     {
-        on_stream->callback("", true, on_stream->data);
-    }
+        const llama_model *model;
+        bool batch;
+        uint32_t n_ubatch;
+        int max_threads;
 
-    // Cleanup
-    llama_sampler_free(smpl);
+        bool operator<(const key &other) const
+        {
+            return std::tie(model, batch, n_ubatch, max_threads) < std::tie(other.model, other.batch, other.n_ubatch, other.max_threads);
+        }
+    };
 
-    return generated_text;
-}
+    std::mutex _mutex;
+    std::map<key, int> _threads;
+};
 
-void releaseContext(llama_context *ctx)
+tuned_threads_cache g_tuned_threads;
+
+void freeModel(llama_model *model)
 {
-    if (ctx)
-    {
-        llama_free(ctx);
-    }
+    g_grammars.forget(model);
+    g_vocab_matches.forget(model);
+    g_tuned_threads.forget(model);
+    llama_free_model(model);
 }
 
-void releaseModel(llama_model *model)
+//  Models are keyed by path, modification time and the load parameters that change the loaded weights or where
+//  they live - placing on NUMA nodes reads them instead of mapping, which only happens once distribute is active
+std::string modelKey(const std::string &model_path, const llama_model_params &params)
 {
-    if (model)
-    {
-        llama_free_model(model);
-    }
+    struct stat st;
+    long long mtime = stat(model_path.c_str(), &st) == 0 ? static_cast<long long>(st.st_mtime) : 0;
+
+    return model_path + "|" + std::to_string(mtime) +
+           "|" + std::to_string(params.n_gpu_layers) +
+           "|" + std::to_string(params.split_mode) +
+           "|" + std::to_string(params.main_gpu) +
+           "|" + std::to_string(params.vocab_only) +
+           "|" + std::to_string(params.use_mmap) +
+           "|" + std::to_string(params.use_mlock) +
+           "|" + std::to_string(params.check_tensors) +
+           "|" + std::to_string(params.use_prefetch) +
+           "|" + std::to_string(params.numa_place) +
+           "|" + std::to_string(ggml_numa_n_nodes() > 0);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
-// SYNC
-////////////////////////////////////////////////////////////////////////////////////////////////////
-
-Napi::Value SetLogLevel(const Napi::CallbackInfo &info)
+//  Process wide registry of loaded models - loads of the same file share one llama_model, models
+//  nobody references anymore stay cached (most recently used first) until they exceed the memory budget
+class model_registry
 {
-    Napi::Env env = info.Env();
-
-    if (info.Length() < 1 || !info[0].IsNumber())
+public:
+    llama_model *acquire(const std::string &model_path, const llama_model_params &params)
     {
-        Napi::TypeError::New(env, "Expected a number").ThrowAsJavaScriptException();
-        return env.Null();
-    }
+        const std::string key = modelKey(model_path, params);
 
-    int log_level = info[0].As<Napi::Number>().Int32Value();
-    g_logLevel = log_level;
-
-    return env.Undefined();
-}
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = find(key);
+            if (it != _entries.end())
+            {
+                it->refs++;
+                _entries.splice(_entries.begin(), _entries, it);
+                return it->model;
+            }
+        }
 
-struct RunInferenceOptions
-{
-    std::string modelPath;
-    std::string prompt;
-    std::string systemPrompt;
-    int maxTokens = 1024;
-    int threads = 1;
-    size_t seed = LLAMA_DEFAULT_SEED;
-    int nCtx = 0;
-    bool flashAttention = true;
-    Napi::FunctionReference callback;
-};
+        //  Load outside of the lock so other models stay available meanwhile
+        llama_model *model = loadModelFromFile(model_path, params);
+        if (model == nullptr)
+        {
+            return nullptr;
+        }
 
-RunInferenceOptions ParseRunInferenceOptions(const Napi::CallbackInfo &info)
-{
-    Napi::Env env = info.Env();
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = find(key);
+        if (it != _entries.end())
+        {
+            //  Somebody else loaded it first, use theirs
+            freeModel(model);
+            it->refs++;
+            _entries.splice(_entries.begin(), _entries, it);
+            return it->model;
+        }
 
-    if (info.Length() < 1 || !info[0].IsObject())
-    {
-        Napi::TypeError::New(env, "Expected an options object").ThrowAsJavaScriptException();
-        return {};
+        _entries.push_front({key, model, 1, llama_model_size(model)});
+        return model;
     }
 
-    Napi::Object optionsObj = info[0].As<Napi::Object>();
-    RunInferenceOptions options;
-
-    if (optionsObj.Has("modelPath") && optionsObj.Get("modelPath").IsString())
+    void release(llama_model *model)
     {
-        options.modelPath = optionsObj.Get("modelPath").As<Napi::String>().Utf8Value();
+        std::vector<llama_model *> evicted;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = std::find_if(_entries.begin(), _entries.end(), [model](const entry &e)
+                                   { return e.model == model; });
+            if (it == _entries.end())
+            {
+                evicted.push_back(model);
+            }
+            else if (it->refs > 0)
+            {
+                it->refs--;
+            }
+            evict(evicted);
+        }
+
+        for (llama_model *m : evicted)
+        {
+            freeModel(m);
+        }
     }
-    else
+
+    void setBudget(size_t budget)
     {
-        Napi::TypeError::New(env, "modelPath is required and should be a string").ThrowAsJavaScriptException();
-        return {};
+        std::vector<llama_model *> evicted;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _budget = budget;
+            evict(evicted);
+        }
+
+        for (llama_model *m : evicted)
+        {
+            freeModel(m);
+        }
     }
 
-    if (optionsObj.Has("prompt") && optionsObj.Get("prompt").IsString())
+private:
+    struct entry
     {
-        options.prompt = optionsObj.Get("prompt").As<Napi::String>().Utf8Value();
-    }
-    else
+        std::string key;
+        llama_model *model;
+        int refs;
+        size_t size;
+    };
+
+    std::list<entry>::iterator find(const std::string &key)
     {
-        Napi::TypeError::New(env, "prompt is required and should be a string").ThrowAsJavaScriptException();
-        return {};
+        return std::find_if(_entries.begin(), _entries.end(), [&key](const entry &e)
+                            { return e.key == key; });
     }
 
-    if (optionsObj.Has("systemPrompt") && optionsObj.Get("systemPrompt").IsString())
+    //  Drops least recently used unreferenced models until the cached ones fit the budget
+    void evict(std::vector<llama_model *> &evicted)
     {
-        options.systemPrompt = optionsObj.Get("systemPrompt").As<Napi::String>().Utf8Value();
+        size_t idle = 0;
+        for (const entry &e : _entries)
+        {
+            idle += e.refs == 0 ? e.size : 0;
+        }
+
+        for (auto it = _entries.end(); it != _entries.begin() && idle > _budget;)
+        {
+            --it;
+            if (it->refs == 0)
+            {
+                idle -= it->size;
+                evicted.push_back(it->model);
+                it = _entries.erase(it);
+            }
+        }
     }
 
-    if (optionsObj.Has("maxTokens") && optionsObj.Get("maxTokens").IsNumber())
+    std::mutex _mutex;
+    std::list<entry> _entries;
+    size_t _budget = 0;
+};
+
+model_registry g_models;
+
+//  Generations would hold a libuv thread (4 by default) for their whole run and starve fs, dns and
+//  crypto work of the same process, so async work runs on threads of its own. A job that finds every
+//  thread busy starts a new one up to the limit, idle threads wait for the next job.
+class worker_pool
+{
+public:
+    static worker_pool &instance()
     {
-        options.maxTokens = optionsObj.Get("maxTokens").As<Napi::Number>().Int32Value();
+        //  Never destroyed, a job still running at exit goes down with the process
+        static worker_pool *pool = new worker_pool();
+        return *pool;
     }
 
-    if (optionsObj.Has("threads") && optionsObj.Get("threads").IsNumber())
+    void submit(std::function<void()> job)
     {
-        options.threads = optionsObj.Get("threads").As<Napi::Number>().Int32Value();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _jobs.push_back(std::move(job));
+        grow();
+        _cv.notify_one();
     }
 
-    if (optionsObj.Has("seed") && optionsObj.Get("seed").IsNumber())
+    //  Surplus threads leave once they are idle, queued jobs wait for a free thread. Returns the old limit.
+    size_t setMaxThreads(size_t maxThreads)
     {
-        options.seed = optionsObj.Get("seed").As<Napi::Number>().Uint32Value();
+        std::lock_guard<std::mutex> lock(_mutex);
+        size_t previous = _maxThreads;
+        _maxThreads = std::max<size_t>(1, maxThreads);
+        grow();
+        _cv.notify_all();
+        return previous;
     }
 
-    if (optionsObj.Has("nCtx") && optionsObj.Get("nCtx").IsNumber())
+    size_t maxThreads()
     {
-        options.nCtx = optionsObj.Get("nCtx").As<Napi::Number>().Int32Value();
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _maxThreads;
     }
 
-    if (optionsObj.Has("flashAttention") && optionsObj.Get("flashAttention").IsBoolean())
+private:
+    void grow()
     {
-        options.flashAttention = optionsObj.Get("flashAttention").As<Napi::Boolean>().Value();
+        while (_jobs.size() > _idle + _starting && _threads < _maxThreads)
+        {
+            _threads++;
+            _starting++;
+            std::thread(&worker_pool::run, this).detach();
+        }
     }
 
-    if (optionsObj.Has("onStream") && optionsObj.Get("onStream").IsFunction())
+    void run()
     {
-        options.callback = Napi::Persistent(optionsObj.Get("onStream").As<Napi::Function>());
+        std::unique_lock<std::mutex> lock(_mutex);
+        _starting--;
+        while (true)
+        {
+            _idle++;
+            _cv.wait(lock, [this]
+                     { return !_jobs.empty() || _threads > _maxThreads; });
+            _idle--;
+
+            if (_threads > _maxThreads)
+            {
+                _threads--;
+                return;
+            }
+
+            std::function<void()> job = std::move(_jobs.front());
+            _jobs.pop_front();
+
+            lock.unlock();
+            job();
+            lock.lock();
+        }
     }
 
-    return options;
-}
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::function<void()>> _jobs;
+    size_t _maxThreads = std::max(4u, std::thread::hardware_concurrency());
+    size_t _threads = 0;
+    size_t _idle = 0;
+    size_t _starting = 0; // spawned but not yet waiting, counted as idle so one job starts one thread
+};
 
-Napi::Value RunInference(const Napi::CallbackInfo &info)
+//  How the weights get into memory, the defaults map the file and read it ahead
+struct model_load_options
 {
-    Napi::Env env = info.Env();
-    RunInferenceOptions options = ParseRunInferenceOptions(info);
+    bool useMmap = true;
+    bool useMlock = false;
+    bool prefetch = true;
+    ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
+    //  With "distribute" every node gets the weight rows its own threads multiply, read into memory instead of mapped
+    bool numaPlace = true;
+    //  Cold starts from fast disks are bound by one core reading, a few threads keep several reads in flight
+    int threads = std::max(1, std::min(4, static_cast<int>(std::thread::hardware_concurrency())));
+};
 
-    stream_callback_info streamInfo;
-    streamInfo.callback = [](const std::string &text, bool done, void *data)
-    {
-        auto callback = static_cast<Napi::FunctionReference *>(data);
-        auto env = callback->Env();
-        Napi::HandleScope scope(env);
-        callback->Call({Napi::String::New(env, text), Napi::Boolean::New(env, done)});
-    };
-    streamInfo.data = &options.callback;
+//  NUMA placement is process wide, the first load asking for a strategy decides it for all later ones
+bool initNuma(ggml_numa_strategy numa)
+{
+    static std::mutex mutex;
+    static ggml_numa_strategy current = GGML_NUMA_STRATEGY_DISABLED;
 
-    std::string response;
+    if (numa == GGML_NUMA_STRATEGY_DISABLED)
+    {
+        return true;
+    }
 
-    llama_model *model = loadModel(options.modelPath);
-    if (model != nullptr)
+    std::lock_guard<std::mutex> lock(mutex);
+    if (current == GGML_NUMA_STRATEGY_DISABLED)
     {
-        llama_context *ctx = createContext(model, options.threads, options.nCtx, options.flashAttention);
-        if (ctx != nullptr)
-        {
-            response = runInference(model, ctx, options.systemPrompt, options.prompt, options.maxTokens, options.seed, (options.callback.IsEmpty() ? nullptr : &streamInfo));
-            releaseContext(ctx);
-        }
-        releaseModel(model);
+        initBackend();
+        llama_numa_init(numa);
+        current = numa;
     }
+    return current == numa;
+}
 
-    return Napi::String::New(env, response);
+//  The progress callback only runs when the model is not cached already
+llama_model *loadModel(const std::string &model_path,
+                       const model_load_options &options = model_load_options(),
+                       llama_progress_callback progress = nullptr,
+                       void *progressData = nullptr)
+{
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = options.useMmap;
+    model_params.use_mlock = options.useMlock;
+    model_params.use_prefetch = options.prefetch;
+    model_params.numa_place = options.numaPlace;
+    model_params.n_threads_load = options.threads;
+    model_params.progress_callback = progress;
+    model_params.progress_callback_user_data = progressData;
+    return g_models.acquire(model_path, model_params);
 }
 
-Napi::Value GetModelToken(const Napi::CallbackInfo &info)
+//  Cancellation of a running inference - set from JS (AbortSignal) or by a deadline, checked by
+//  the generation loop between tokens and by ggml between graph nodes through the abort callback
+struct cancel_state
 {
-    Napi::Env env = info.Env();
+    std::atomic<bool> cancelled{false};
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    bool expired = false; // inference thread only
+    bool finished = false; // inference thread only, the reply was reported complete and a late abort no longer counts
 
-    if (info.Length() < 2 || !info[0].IsExternal() || !info[1].IsString())
+    bool stopped()
     {
-        Napi::TypeError::New(env, "Model handle expected").ThrowAsJavaScriptException();
-        return env.Undefined();
+        if (!expired && deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline)
+        {
+            expired = true;
+        }
+        return expired || cancelled.load(std::memory_order_relaxed);
     }
 
-    llama_model *model = info[0].As<Napi::External<llama_model>>().Data();
-    if (!model)
+    bool triggered() const
     {
-        Napi::TypeError::New(env, "Invalid model handle").ThrowAsJavaScriptException();
-        return env.Undefined();
+        return !finished && (expired || cancelled.load(std::memory_order_relaxed));
     }
 
-    std::string token_name = info[1].As<Napi::String>().Utf8Value();
-    if (token_name.length() < 1)
+    const char *reason() const
     {
-        Napi::TypeError::New(env, "Token name expected").ThrowAsJavaScriptException();
-        return env.Undefined();
+        return expired ? "Inference deadline exceeded" : "Inference cancelled";
     }
+};
 
-    llama_token token = -1;
+//  Persistent ggml threadpool, kept alive by every context attached to it (and by the JS handle)
+struct threadpool_handle
+{
+    ggml_threadpool *pool = nullptr;
+    int n_threads = 0;
+    std::mutex compute; // contexts sharing the pool take turns computing their graphs
+    std::atomic<int> refs{1};
+};
 
-    if (token_name == "BOS")
-    {
-        token = llama_token_bos(model);
-    }
-    else if (token_name == "EOS")
+threadpool_handle *createThreadpool(const ggml_threadpool_params &params)
+{
+    ggml_threadpool_params pool_params = params;
+    ggml_threadpool *pool = ggml_threadpool_new(&pool_params);
+    if (!pool)
     {
-        token = llama_token_eos(model);
+        fprintf(stderr, "Error: Failed to create the threadpool\n");
+        return nullptr;
     }
-    else if (token_name == "PAD")
-    {
+
+    threadpool_handle *handle = new threadpool_handle();
+    handle->pool = pool;
+    handle->n_threads = params.n_threads;
+    return handle;
+}
+
+threadpool_handle *retainThreadpool(threadpool_handle *handle)
+{
+    handle->refs.fetch_add(1, std::memory_order_relaxed);
+    return handle;
+}
+
+void releaseThreadpool(threadpool_handle *handle)
+{
+    if (handle != nullptr && handle->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        ggml_threadpool_free(handle->pool);
+        delete handle;
+    }
+}
+
+//  Context handle passed around to JS, keeps track of the tokens currently held in the KV cache
+struct context_handle
+{
+    llama_context *ctx = nullptr;
+    std::vector<llama_token> cached_tokens;        // tokens decoded into sequence 0, in position order
+    cancel_state *cancel = nullptr;                // set only while a cancellable inference runs
+    threadpool_handle *threadpool = nullptr;       // single token decodes
+    threadpool_handle *threadpool_batch = nullptr; // prompt processing
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    size_t kv_size_max = 0;             // bytes of the KV cache once it holds n_ctx cells
+    std::atomic<size_t> kv_size{0};     // bytes allocated right now, refreshed after every decode
+};
+
+//  Called by ggml after every graph node, aborting releases all compute threads right away
+bool abortContext(void *data)
+{
+    context_handle *handle = static_cast<context_handle *>(data);
+    return handle->cancel != nullptr && handle->cancel->stopped();
+}
+
+//  Thread count picked by timing a few decodes when the context gets created
+const int THREADS_AUTO = -1;
+
+llama_context_params buildContextParams(int n_thread, int n_ctx, bool flash_attn)
+{
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = n_ctx; // 0 means load from model
+    ctx_params.n_ctx_init = 512; // KV cache starts this small and grows up to n_ctx on demand
+    ctx_params.no_perf = true;
+    ctx_params.flash_attn = flash_attn;
+    ctx_params.n_threads = n_thread;
+    ctx_params.n_threads_batch = n_thread;
+    return ctx_params;
+}
+
+//  Times single token decodes (or prompt sized batches) with increasing thread counts and returns
+//  the fastest one, stops as soon as adding threads makes it slower
+int tuneThreads(llama_context *ctx, const llama_model *model, bool batch, int max_threads)
+{
+    std::vector<int> candidates = {max_threads / 4, max_threads / 2, max_threads * 3 / 4, max_threads};
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [](int n)
+                                    { return n < 1; }),
+                     candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    std::vector<llama_token> tokens(batch ? std::min<uint32_t>(64, llama_n_ubatch(ctx)) : 1, std::max<llama_token>(llama_token_bos(model), 0));
+
+    int best_threads = max_threads;
+    double best_time = 0;
+
+    for (int n_threads : candidates)
+    {
+        llama_set_n_threads(ctx, n_threads, n_threads);
+
+        //  First run only warms up the compute buffers
+        double time = std::numeric_limits<double>::max();
+        for (int i = 0; i < 3; i++)
+        {
+            llama_kv_cache_clear(ctx);
+            auto start = std::chrono::steady_clock::now();
+            if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) != 0)
+            {
+                llama_kv_cache_clear(ctx);
+                return best_threads;
+            }
+
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (i > 0)
+            {
+                time = std::min(time, elapsed);
+            }
+        }
+
+        if (best_time == 0 || time < best_time)
+        {
+            best_threads = n_threads;
+            best_time = time;
+        }
+        else if (time > best_time * 1.05)
+        {
+            break;
+        }
+    }
+
+    llama_kv_cache_clear(ctx);
+    return best_threads;
+}
+
+//  Passing threadpools shares them with other contexts, otherwise the context gets its own so no
+//  graph ever waits for threads to be spawned
+context_handle *createContext(llama_model *model, llama_context_params ctx_params, threadpool_handle *threadpool = nullptr,
+                              threadpool_handle *threadpool_batch = nullptr)
+{
+    if (!model)
+    {
+        fprintf(stderr, "Error: Invalid model handle\n");
+        return nullptr;
+    }
+
+    const int max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    threadpool_batch = threadpool_batch != nullptr ? threadpool_batch : threadpool;
+    if (threadpool != nullptr)
+    {
+        ctx_params.n_threads = threadpool->n_threads;
+    }
+    if (threadpool_batch != nullptr)
+    {
+        ctx_params.n_threads_batch = threadpool_batch->n_threads;
+    }
+
+    bool tune = ctx_params.n_threads == THREADS_AUTO;
+    bool tune_batch = ctx_params.n_threads_batch == THREADS_AUTO;
+    ctx_params.n_threads = tune ? max_threads : ctx_params.n_threads;
+    ctx_params.n_threads_batch = tune_batch ? max_threads : ctx_params.n_threads_batch;
+
+    llama_context *ctx = llama_new_context_with_model(model, ctx_params);
+    if (!ctx)
+    {
+        fprintf(stderr, "Error: Failed to create the llama_context\n");
+        return nullptr;
+    }
+
+    if (tune)
+    {
+        const int threads = g_tuned_threads.find(model, false, llama_n_ubatch(ctx), max_threads);
+        tune = threads == 0;
+        ctx_params.n_threads = tune ? ctx_params.n_threads : threads;
+    }
+    if (tune_batch)
+    {
+        const int threads = g_tuned_threads.find(model, true, llama_n_ubatch(ctx), max_threads);
+        tune_batch = threads == 0;
+        ctx_params.n_threads_batch = tune_batch ? ctx_params.n_threads_batch : threads;
+    }
+
+    if (tune || tune_batch)
+    {
+        threadpool_handle *tuning = createThreadpool(ggml_threadpool_params_default(max_threads));
+        if (tuning != nullptr)
+        {
+            llama_attach_threadpool(ctx, tuning->pool, tuning->pool);
+            if (tune)
+            {
+                ctx_params.n_threads = tuneThreads(ctx, model, false, max_threads);
+                g_tuned_threads.store(model, false, llama_n_ubatch(ctx), max_threads, ctx_params.n_threads);
+            }
+            if (tune_batch)
+            {
+                ctx_params.n_threads_batch = tuneThreads(ctx, model, true, max_threads);
+                g_tuned_threads.store(model, true, llama_n_ubatch(ctx), max_threads, ctx_params.n_threads_batch);
+            }
+            llama_detach_threadpool(ctx);
+            releaseThreadpool(tuning);
+        }
+    }
+
+    context_handle *handle = new context_handle();
+    handle->ctx = ctx;
+
+    handle->threadpool = threadpool != nullptr ? retainThreadpool(threadpool) : createThreadpool(ggml_threadpool_params_default(ctx_params.n_threads));
+    if (threadpool_batch != nullptr)
+    {
+        handle->threadpool_batch = retainThreadpool(threadpool_batch);
+    }
+    else if (handle->threadpool != nullptr && ctx_params.n_threads_batch == ctx_params.n_threads)
+    {
+        handle->threadpool_batch = retainThreadpool(handle->threadpool);
+    }
+    else
+    {
+        handle->threadpool_batch = createThreadpool(ggml_threadpool_params_default(ctx_params.n_threads_batch));
+    }
+
+    if (handle->threadpool == nullptr || handle->threadpool_batch == nullptr)
+    {
+        releaseThreadpool(handle->threadpool);
+        releaseThreadpool(handle->threadpool_batch);
+        llama_free(ctx);
+        delete handle;
+        return nullptr;
+    }
+
+    llama_attach_threadpool(ctx, handle->threadpool->pool, handle->threadpool_batch->pool);
+    llama_set_n_threads(ctx, ctx_params.n_threads, ctx_params.n_threads_batch);
+    llama_set_abort_callback(ctx, abortContext, handle);
+
+    handle->type_k = ctx_params.type_k;
+    handle->type_v = ctx_params.type_v;
+    handle->kv_size_max = llama_get_kv_cache_size_max(ctx);
+    handle->kv_size = llama_get_kv_cache_size(ctx);
+    return handle;
+}
+
+context_handle *createContext(llama_model *model, int n_thread = 1, int n_ctx = 0, bool flash_attn = true)
+{
+    return createContext(model, buildContextParams(n_thread, n_ctx, flash_attn));
+}
+
+//  Decodes (or encodes) a batch, holding the threadpools so contexts sharing them never compute at once
+int decodeContext(context_handle *handle, const llama_batch &batch, bool encode = false)
+{
+    std::unique_lock<std::mutex> lock(handle->threadpool->compute, std::defer_lock);
+    std::unique_lock<std::mutex> lock_batch(handle->threadpool_batch->compute, std::defer_lock);
+    if (handle->threadpool == handle->threadpool_batch)
+    {
+        lock.lock();
+    }
+    else
+    {
+        std::lock(lock, lock_batch);
+    }
+
+    const int status = encode ? llama_encode(handle->ctx, batch) : llama_decode(handle->ctx, batch);
+    handle->kv_size = llama_get_kv_cache_size(handle->ctx);
+    return status;
+}
+
+//  Non owning view of prompt tokens, either a vector or the backing store of a JS Int32Array
+struct token_view
+{
+    const llama_token *ptr = nullptr;
+    size_t count = 0;
+
+    token_view() {}
+    token_view(const std::vector<llama_token> &tokens) : ptr(tokens.data()), count(tokens.size()) {}
+    token_view(const llama_token *data, size_t size) : ptr(data), count(size) {}
+
+    const llama_token *data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    llama_token operator[](size_t i) const { return ptr[i]; }
+};
+
+bool tokensInVocab(const llama_model *model, token_view tokens)
+{
+    const int n_vocab = llama_n_vocab(model);
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//  Drops everything after the longest common prefix of the cached and the new prompt tokens, returns number of reused tokens
+size_t reuseCachedPrefix(context_handle *handle, token_view prompt_tokens)
+{
+    std::vector<llama_token> &cached = handle->cached_tokens;
+
+    size_t n_past = 0;
+    while (n_past < cached.size() && n_past < prompt_tokens.size() && cached[n_past] == prompt_tokens[n_past])
+    {
+        n_past++;
+    }
+
+    //  At least one prompt token has to be decoded again so we get fresh logits to sample from
+    if (n_past == prompt_tokens.size() && n_past > 0)
+    {
+        n_past--;
+    }
+
+    if (!llama_kv_cache_seq_rm(handle->ctx, 0, n_past, -1))
+    {
+        //  Partial removal is not supported for recurrent models, start from scratch
+        llama_kv_cache_clear(handle->ctx);
+        n_past = 0;
+    }
+
+    cached.resize(n_past);
+    return n_past;
+}
+
+struct chat_message
+{
+    std::string role;
+    std::string content;
+};
+
+//  Renders messages with the given template, or the one built into the model when empty
+bool renderChat(const llama_model *model, const std::string &tmpl, const std::vector<chat_message> &messages, bool add_assistant, std::string &out)
+{
+    std::vector<llama_chat_message> chat;
+    chat.reserve(messages.size());
+    size_t length = 0;
+    for (const chat_message &message : messages)
+    {
+        chat.push_back({message.role.c_str(), message.content.c_str()});
+        length += message.role.size() + message.content.size();
+    }
+
+    const char *tmpl_str = tmpl.empty() ? nullptr : tmpl.c_str();
+
+    out.resize(std::max<size_t>(2 * length, 256));
+    int32_t n = llama_chat_apply_template(model, tmpl_str, chat.data(), chat.size(), add_assistant, &out[0], out.size());
+    if (n > static_cast<int32_t>(out.size()))
+    {
+        out.resize(n);
+        n = llama_chat_apply_template(model, tmpl_str, chat.data(), chat.size(), add_assistant, &out[0], out.size());
+    }
+
+    if (n < 0)
+    {
+        out.clear();
+        return false;
+    }
+
+    out.resize(n);
+    return true;
+}
+
+std::string formatPrompt(const llama_model *model, const std::string &system_prompt, const std::string &user_prompt)
+{
+    //  Complete prompt prepared by the caller, prefix gets removed
+    bool isFullPrompt = user_prompt.size() > 2 && user_prompt[0] == '!' && user_prompt[1] == '#';
+    if (isFullPrompt)
+    {
+        return user_prompt.substr(2);
+    }
+
+    std::vector<chat_message> messages;
+    if (!system_prompt.empty())
+    {
+        messages.push_back({"system", system_prompt});
+    }
+    messages.push_back({"user", user_prompt});
+
+    std::string prompt;
+    if (renderChat(model, "", messages, true, prompt))
+    {
+        return prompt;
+    }
+
+    //  Model without a supported template, fall back to ChatML
+    return "<|im_start|>system " + system_prompt + "<|im_end|>" +
+           "<|im_start|>user " + user_prompt + "<|im_end|>" +
+           "<|im_start|>assistant";
+}
+
+//  Tokenizes with a buffer sized for the common case and only retries when it was too small
+bool tokenizeText(const llama_model *model, const std::string &text, bool add_special, bool parse_special,
+                  std::vector<llama_token> &tokens)
+{
+    tokens.resize(text.size() + 2);
+    int n = llama_tokenize(model, text.c_str(), text.size(), tokens.data(), tokens.size(), add_special, parse_special);
+    if (n < 0)
+    {
+        tokens.resize(-n);
+        n = llama_tokenize(model, text.c_str(), text.size(), tokens.data(), tokens.size(), add_special, parse_special);
+    }
+
+    tokens.resize(std::max(n, 0));
+    return n >= 0;
+}
+
+bool tokenizePrompt(const llama_model *model, const std::string &text, std::vector<llama_token> &tokens, bool add_special = true)
+{
+    if (!tokenizeText(model, text, add_special, true, tokens))
+    {
+        tokens.clear();
+        return false;
+    }
+    return !tokens.empty() || !add_special;
+}
+
+//  Sampler chain configuration, only used when the caller passes a sampling object
+struct sampling_params
+{
+    bool enabled = false;
+
+    std::vector<llama_logit_bias> logitBias;
+
+    int32_t topK = 40;
+    int32_t penaltyLastN = 64;
+    float repeatPenalty = 1.0f;
+    float frequencyPenalty = 0.0f;
+    float presencePenalty = 0.0f;
+
+    float dryMultiplier = 0.0f;
+    float dryBase = 1.75f;
+    int32_t dryAllowedLength = 2;
+    int32_t dryPenaltyLastN = -1;
+    std::vector<std::string> drySequenceBreakers = {"\n", ":", "\"", "*"};
+
+    float typicalP = 1.0f;
+    float topP = 0.95f;
+    float minP = 0.05f;
+    float xtcProbability = 0.0f;
+    float xtcThreshold = 0.1f;
+
+    float temperature = 0.8f;
+    float dynatempRange = 0.0f;
+    float dynatempExponent = 1.0f;
+
+    int32_t mirostat = 0; // 0 = off, 1 = mirostat, 2 = mirostat 2.0
+    float mirostatTau = 5.0f;
+    float mirostatEta = 0.1f;
+
+    std::string grammar; // GBNF with a root rule, also used without the sampling options
+};
+
+//  Decide on a mode of the sampler - greedy is deterministic and consistent, distributed is more creative
+llama_sampler *createSampler(llama_model *model, size_t seed, const sampling_params &sampling)
+{
+    auto sparams = llama_sampler_chain_default_params();
+    sparams.no_perf = false;
+
+    llama_sampler *smpl = llama_sampler_chain_init(sparams);
+
+    //  Grammar goes first so every later stage only sees tokens the grammar allows
+    if (!sampling.grammar.empty())
+    {
+        std::shared_ptr<llama_sampler> grammar = g_grammars.acquire(model, sampling.grammar);
+        if (!grammar)
+        {
+            fprintf(stderr, "Error: Failed to parse the grammar\n");
+            llama_sampler_free(smpl);
+            return nullptr;
+        }
+        llama_sampler_chain_add(smpl, llama_sampler_clone(grammar.get()));
+    }
+
+    if (!sampling.enabled)
+    {
+        seed == LLAMA_DEFAULT_SEED ? llama_sampler_chain_add(smpl, llama_sampler_init_greedy()) : llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+        return smpl;
+    }
+
+    if (!sampling.logitBias.empty())
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_logit_bias(llama_n_vocab(model), sampling.logitBias.size(), sampling.logitBias.data()));
+    }
+
+    //  Mirostat picks its own candidate set, only temperature goes before it
+    if (sampling.mirostat == 1 || sampling.mirostat == 2)
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(sampling.temperature));
+        sampling.mirostat == 1 ? llama_sampler_chain_add(smpl, llama_sampler_init_mirostat(llama_n_vocab(model), seed, sampling.mirostatTau, sampling.mirostatEta, 100))
+                               : llama_sampler_chain_add(smpl, llama_sampler_init_mirostat_v2(seed, sampling.mirostatTau, sampling.mirostatEta));
+        return smpl;
+    }
+
+    //  Cheap truncation goes first so the more expensive stages only see the remaining candidates
+    if (sampling.topK > 0)
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(sampling.topK));
+    }
+
+    if (sampling.repeatPenalty != 1.0f || sampling.frequencyPenalty != 0.0f || sampling.presencePenalty != 0.0f)
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_penalties(sampling.penaltyLastN, sampling.repeatPenalty, sampling.frequencyPenalty, sampling.presencePenalty));
+    }
+
+    if (sampling.dryMultiplier > 0.0f)
+    {
+        std::vector<const char *> breakers;
+        for (const std::string &breaker : sampling.drySequenceBreakers)
+        {
+            breakers.push_back(breaker.c_str());
+        }
+        llama_sampler_chain_add(smpl, llama_sampler_init_dry(model, sampling.dryMultiplier, sampling.dryBase, sampling.dryAllowedLength,
+                                                             sampling.dryPenaltyLastN, breakers.data(), breakers.size()));
+    }
+
+    if (sampling.typicalP < 1.0f)
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_typical(sampling.typicalP, 1));
+    }
+
+    if (sampling.topP < 1.0f)
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(sampling.topP, 1));
+    }
+
+    if (sampling.minP > 0.0f)
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_min_p(sampling.minP, 1));
+    }
+
+    if (sampling.xtcProbability > 0.0f)
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_xtc(sampling.xtcProbability, sampling.xtcThreshold, 1, seed));
+    }
+
+    //  Zero temperature means deterministic pick of the best remaining candidate
+    if (sampling.temperature <= 0.0f)
+    {
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+        return smpl;
+    }
+
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp_ext(sampling.temperature, sampling.dynatempRange, sampling.dynatempExponent));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+    return smpl;
+}
+
+//  Guesses ahead of the target that get verified in one target decode, made either by a small draft model
+//  or by looking up the latest tokens in the prompt and reply (no extra weights, great when the reply copies)
+struct draft_params
+{
+    context_handle *context = nullptr; // context of the draft model, never shared with the target
+    int ngram = 0;                     // without a draft model, longest n-gram looked up
+    int maxTokens = 8;                 // longest guess per target decode
+    float pMin = 0.75f;                // stop guessing once the draft model is less sure than this
+
+    bool enabled() const
+    {
+        return context != nullptr || ngram > 0;
+    }
+};
+
+//  Draft tokens are fed to the target as they are, so both models have to tokenize the same way
+bool vocabMatches(const llama_model *target, const llama_model *draft)
+{
+    const int n_target = llama_n_vocab(target);
+    const int n_draft = llama_n_vocab(draft);
+
+    //  Models of one family often pad the vocabulary differently
+    if (llama_vocab_type(target) != llama_vocab_type(draft) || std::abs(n_target - n_draft) > 128)
+    {
+        return false;
+    }
+
+    if (llama_token_bos(target) != llama_token_bos(draft) || llama_token_eos(target) != llama_token_eos(draft) ||
+        llama_add_bos_token(target) != llama_add_bos_token(draft))
+    {
+        return false;
+    }
+
+    for (int i = 0; i < std::min(n_target, n_draft); i++)
+    {
+        if (strcmp(llama_token_get_text(target, i), llama_token_get_text(draft, i)) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool draftCompatible(const llama_model *target, const llama_model *draft)
+{
+    int match = g_vocab_matches.find(target, draft);
+    if (match < 0)
+    {
+        match = vocabMatches(target, draft);
+        g_vocab_matches.store(target, draft, match);
+    }
+    return match;
+}
+
+//  Greedily continues sequence with the draft model, returns at most n_draft tokens the target can decode
+std::vector<llama_token> draftTokens(const draft_params &draft, const std::vector<llama_token> &sequence, int n_draft, int n_vocab_target)
+{
+    context_handle *handle = draft.context;
+    const int n_vocab = llama_n_vocab(llama_get_model(handle->ctx));
+    std::vector<llama_token> result;
+
+    const size_t n_past = reuseCachedPrefix(handle, sequence);
+    llama_batch batch = llama_batch_get_one(const_cast<llama_token *>(sequence.data()) + n_past, sequence.size() - n_past);
+    llama_token token;
+
+    while (static_cast<int>(result.size()) < n_draft)
+    {
+        if (decodeContext(handle, batch) != 0)
+        {
+            llama_kv_cache_seq_rm(handle->ctx, 0, handle->cached_tokens.size(), -1);
+            break;
+        }
+        handle->cached_tokens.insert(handle->cached_tokens.end(), batch.token, batch.token + batch.n_tokens);
+
+        //  Probability of the best token, without sorting the whole vocabulary
+        const float *logits = llama_get_logits_ith(handle->ctx, -1);
+        token = static_cast<llama_token>(std::max_element(logits, logits + n_vocab) - logits);
+
+        double sum = 0.0;
+        for (int i = 0; i < n_vocab; i++)
+        {
+            sum += std::exp(logits[i] - logits[token]);
+        }
+
+        if (1.0 / sum < draft.pMin || token >= n_vocab_target)
+        {
+            break;
+        }
+
+        result.push_back(token);
+        batch = llama_batch_get_one(&token, 1);
+    }
+
+    return result;
+}
+
+//  Shorter keys match all over the text and mostly propose tokens the target rejects
+const int LOOKUP_NGRAM_MIN = 2;
+
+//  Finds the most recent earlier occurrence of the last n tokens (longest n first) and proposes what followed it
+std::vector<llama_token> lookupTokens(const std::vector<llama_token> &sequence, int ngram, int n_draft)
+{
+    const int n_seq = sequence.size();
+
+    for (int n = std::min(ngram, n_seq - 1); n >= LOOKUP_NGRAM_MIN; n--)
+    {
+        const llama_token *key = sequence.data() + n_seq - n;
+
+        for (int start = n_seq - n - 1; start >= 0; start--)
+        {
+            if (std::equal(key, key + n, sequence.data() + start))
+            {
+                const int from = start + n;
+                return std::vector<llama_token>(sequence.begin() + from, sequence.begin() + std::min(n_seq, from + n_draft));
+            }
+        }
+    }
+
+    return {};
+}
+
+//  Generates a reply to already tokenized prompt, generated_tokens (when given) receives every sampled non EOG token.
+//  With a draft the target decodes its last token together with the guesses, every guess matching what the target
+//  samples at its position is taken for free, the first mismatch is replaced by the target's own pick.
+std::string runInferenceTokens(llama_model *model, context_handle *handle, token_view prompt_tokens,
+                               int max_tokens, size_t seed, const sampling_params &sampling, stream_callback_info *on_stream,
+                               std::vector<llama_token> *generated_tokens = nullptr, const draft_params *draft = nullptr)
+{
+    if (prompt_tokens.empty())
+    {
+        fprintf(stderr, "Error: Empty prompt\n");
+        return "";
+    }
+
+    llama_context *ctx = handle->ctx;
+    const size_t n_past = reuseCachedPrefix(handle, prompt_tokens);
+
+    // Initialize sampler
+    llama_sampler *smpl = createSampler(model, seed, sampling);
+    if (smpl == nullptr)
+    {
+        return "";
+    }
+
+    // Prepare initial batch, only the part of the prompt not already in the KV cache
+    llama_batch batch = llama_batch_get_one(const_cast<llama_token *>(prompt_tokens.data()) + n_past, prompt_tokens.size() - n_past);
+
+    //  Last sampled token followed by the draft guesses, all of them get logits
+    const int n_draft_max = draft != nullptr ? std::max(0, draft->maxTokens) : 0;
+    llama_batch spec_batch = llama_batch_init(n_draft_max + 1, 0, 1);
+    std::vector<llama_token> drafted;
+
+    // Generate response
+    std::string generated_text;
+    int n_decode = 0; // emitted tokens, at most max_tokens like with plain decoding
+    llama_token new_token_id;
+    bool finished = false;
+
+    for (int n_pos = static_cast<int>(n_past); !finished && n_decode < max_tokens;)
+    {
+        if (handle->cancel != nullptr && handle->cancel->stopped())
+        {
+            break;
+        }
+
+        int status = decodeContext(handle, batch);
+        if (status == 2)
+        {
+            //  Aborted, drop whatever part of the batch made it into the cache
+            llama_kv_cache_seq_rm(ctx, 0, handle->cached_tokens.size(), -1);
+            llama_batch_free(spec_batch);
+            llama_sampler_free(smpl);
+            return "";
+        }
+
+        if (status)
+        {
+            fprintf(stderr, "Error: Failed to decode\n");
+            llama_batch_free(spec_batch);
+            llama_sampler_free(smpl);
+            llama_kv_cache_clear(ctx);
+            handle->cached_tokens.clear();
+            return "";
+        }
+
+        handle->cached_tokens.insert(handle->cached_tokens.end(), batch.token, batch.token + batch.n_tokens);
+        n_pos += batch.n_tokens;
+
+        //  Walk the guesses, batch output i holds the logits following batch token i
+        size_t n_accepted = 0;
+        for (size_t i = 0; i <= drafted.size(); i++)
+        {
+            // Sample next token
+            new_token_id = llama_sampler_sample(smpl, ctx, drafted.empty() ? -1 : static_cast<int32_t>(i));
+
+            // Check for end of generation
+            if (llama_token_is_eog(model, new_token_id))
+            {
+                finished = true;
+                break;
+            }
+
+            // Convert token to text
+            char buf[128];
+            int n = llama_token_to_piece(model, new_token_id, buf, sizeof(buf), 0, true);
+            if (n < 0)
+            {
+                fprintf(stderr, "Error: Failed to convert token to piece\n");
+                llama_batch_free(spec_batch);
+                llama_sampler_free(smpl);
+                return "";
+            }
+
+            // Append to generated text
+            generated_text.append(buf, n);
+            if (generated_tokens != nullptr)
+            {
+                generated_tokens->push_back(new_token_id);
+            }
+
+            if (on_stream != nullptr)
+            {
+                on_stream->callback(buf, n, new_token_id, false, on_stream->data);
+            }
+
+            n_decode += 1;
+            if (i == drafted.size() || new_token_id != drafted[i])
+            {
+                break;
+            }
+            n_accepted++;
+        }
+
+        //  Rejected guesses leave the cache, the token sampled in their place gets decoded next
+        const size_t n_rejected = drafted.size() - n_accepted;
+        if (n_rejected > 0)
+        {
+            n_pos -= n_rejected;
+            llama_kv_cache_seq_rm(ctx, 0, n_pos, -1);
+            handle->cached_tokens.resize(n_pos);
+        }
+
+        if (finished || n_decode >= max_tokens)
+        {
+            break;
+        }
+
+        // Prepare next batch
+        drafted.clear();
+        if (n_draft_max > 0)
+        {
+            std::vector<llama_token> sequence = handle->cached_tokens;
+            sequence.push_back(new_token_id);
+            const int n_draft = std::min(n_draft_max, max_tokens - n_decode - 1);
+            drafted = draft->context != nullptr ? draftTokens(*draft, sequence, n_draft, llama_n_vocab(model)) : lookupTokens(sequence, draft->ngram, n_draft);
+        }
+
+        if (drafted.empty())
+        {
+            batch = llama_batch_get_one(&new_token_id, 1);
+            continue;
+        }
+
+        spec_batch.n_tokens = 0;
+        for (size_t i = 0; i <= drafted.size(); i++)
+        {
+            const int j = spec_batch.n_tokens++;
+            spec_batch.token[j] = i == 0 ? new_token_id : drafted[i - 1];
+            spec_batch.pos[j] = n_pos + j;
+            spec_batch.n_seq_id[j] = 1;
+            spec_batch.seq_id[j][0] = 0;
+            spec_batch.logits[j] = true;
+        }
+        batch = spec_batch;
+    }
+
+    //  Finish the generation
+    if (on_stream != nullptr)
+    {
+        on_stream->callback("", 0, LLAMA_TOKEN_NULL, true, on_stream->data);
+    }
+
+    // Cleanup
+    llama_batch_free(spec_batch);
+    llama_sampler_free(smpl);
+
+    return generated_text;
+}
+
+std::string runInference(llama_model *model, context_handle *handle, const std::string &system_prompt,
+                         const std::string &user_prompt, int max_tokens = 1024, size_t seed = LLAMA_DEFAULT_SEED,
+                         const sampling_params &sampling = sampling_params(), stream_callback_info *on_stream = nullptr,
+                         const draft_params *draft = nullptr)
+{
+    if (!model || !handle || !handle->ctx)
+    {
+        fprintf(stderr, "Error: Invalid model or context handle\n");
+        return "";
+    }
+
+    std::string full_prompt = formatPrompt(model, system_prompt, user_prompt);
+
+    std::vector<llama_token> prompt_tokens;
+    if (!tokenizePrompt(model, full_prompt, prompt_tokens))
+    {
+        fprintf(stderr, "Error: Failed to tokenize the prompt\n");
+        return "";
+    }
+
+    return runInferenceTokens(model, handle, prompt_tokens, max_tokens, seed, sampling, on_stream, nullptr, draft);
+}
+
+//  Conversation rendered through the chat template, kept both as text and as tokens so every turn
+//  only renders and tokenizes what was added and the prompt stays a strict prefix of the KV cache
+struct chat_session
+{
+    std::string tmpl; // empty means the model's own template
+    std::vector<chat_message> messages;
+    std::mutex mutex; // taken by the turn changing messages and by GetChatHistory reading them from JS
+    std::string rendered;            // history without the assistant prefix
+    std::vector<llama_token> tokens; // tokens of rendered, replies kept exactly as sampled
+
+    void push(chat_message message)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        messages.push_back(std::move(message));
+    }
+
+    void pop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        messages.pop_back();
+    }
+};
+
+//  Appends text to tokens, tokenizing only the part after base when text extends it
+bool appendRendered(const llama_model *model, const std::string &base, const std::string &text, std::vector<llama_token> &tokens)
+{
+    std::vector<llama_token> delta;
+    if (!tokens.empty() && text.compare(0, base.size(), base) == 0)
+    {
+        if (!tokenizePrompt(model, text.substr(base.size()), delta, false))
+        {
+            return false;
+        }
+        tokens.insert(tokens.end(), delta.begin(), delta.end());
+        return true;
+    }
+
+    //  Template rewrote earlier parts of the history, start over
+    return tokenizePrompt(model, text, tokens);
+}
+
+std::string runChat(llama_model *model, context_handle *handle, chat_session *chat, const std::string &user_prompt,
+                    int max_tokens, size_t seed, const sampling_params &sampling, stream_callback_info *on_stream,
+                    const draft_params *draft = nullptr)
+{
+    if (!model || !handle || !handle->ctx || !chat)
+    {
+        fprintf(stderr, "Error: Invalid model, context or chat handle\n");
+        return "";
+    }
+
+    chat->push({"user", user_prompt});
+
+    std::string prompt;
+    std::vector<llama_token> prompt_tokens = chat->tokens;
+    if (!renderChat(model, chat->tmpl, chat->messages, true, prompt) || !appendRendered(model, chat->rendered, prompt, prompt_tokens))
+    {
+        fprintf(stderr, "Error: Failed to apply the chat template\n");
+        chat->pop();
+        return "";
+    }
+
+    std::vector<llama_token> generated;
+    std::string reply = runInferenceTokens(model, handle, prompt_tokens, max_tokens, seed, sampling, on_stream, &generated, draft);
+
+    //  A cancelled turn leaves no trace, the next one continues from the last complete reply
+    if (reply.empty() || (handle->cancel != nullptr && handle->cancel->triggered()))
+    {
+        chat->pop();
+        return "";
+    }
+
+    chat->push({"assistant", reply});
+
+    //  Reply tokens stay as generated, only the closing part of the template gets tokenized
+    std::string rendered;
+    std::vector<llama_token> tokens = prompt_tokens;
+    tokens.insert(tokens.end(), generated.begin(), generated.end());
+    if (!renderChat(model, chat->tmpl, chat->messages, false, rendered) || !appendRendered(model, prompt + reply, rendered, tokens))
+    {
+        rendered.clear();
+        tokens.clear();
+    }
+
+    chat->rendered = std::move(rendered);
+    chat->tokens = std::move(tokens);
+    return reply;
+}
+
+void releaseContext(context_handle *handle)
+{
+    if (handle)
+    {
+        llama_free(handle->ctx);
+        releaseThreadpool(handle->threadpool);
+        releaseThreadpool(handle->threadpool_batch);
+        delete handle;
+    }
+}
+
+void releaseModel(llama_model *model)
+{
+    if (model)
+    {
+        g_models.release(model);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// SYNC
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Napi::Value SetLogLevel(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsNumber())
+    {
+        Napi::TypeError::New(env, "Expected a number").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    int log_level = info[0].As<Napi::Number>().Int32Value();
+    g_logLevel = log_level;
+
+    return env.Undefined();
+}
+
+Napi::Value SetWorkerThreads(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsNumber() || info[0].As<Napi::Number>().Int32Value() < 1)
+    {
+        Napi::TypeError::New(env, "Expected a positive number").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    size_t previous = worker_pool::instance().setMaxThreads(info[0].As<Napi::Number>().Int32Value());
+
+    return Napi::Number::New(env, static_cast<double>(previous));
+}
+
+Napi::Value SetModelCacheBudget(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsNumber())
+    {
+        Napi::TypeError::New(env, "Expected a number").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    int64_t budget = info[0].As<Napi::Number>().Int64Value();
+    g_models.setBudget(budget > 0 ? static_cast<size_t>(budget) : 0);
+
+    return env.Undefined();
+}
+
+void ParseNumberOption(const Napi::Object &obj, const char *name, float &value)
+{
+    if (obj.Has(name) && obj.Get(name).IsNumber())
+    {
+        value = obj.Get(name).As<Napi::Number>().FloatValue();
+    }
+}
+
+void ParseNumberOption(const Napi::Object &obj, const char *name, int32_t &value)
+{
+    if (obj.Has(name) && obj.Get(name).IsNumber())
+    {
+        value = obj.Get(name).As<Napi::Number>().Int32Value();
+    }
+}
+
+//  Thread counts are either numbers or "auto"
+void ParseThreadsOption(const Napi::Object &obj, const char *name, int &value)
+{
+    if (!obj.Has(name))
+    {
+        return;
+    }
+
+    Napi::Value option = obj.Get(name);
+    if (option.IsNumber())
+    {
+        value = option.As<Napi::Number>().Int32Value();
+    }
+    else if (option.IsString() && option.As<Napi::String>().Utf8Value() == "auto")
+    {
+        value = THREADS_AUTO;
+    }
+}
+
+//  Prompt is either text or token ids, an Int32Array is used in place from its backing store so the
+//  caller has to leave it untouched until the request finishes. Returns false after throwing.
+bool ParsePromptOption(const Napi::Object &optionsObj, std::string &prompt, token_view &tokens)
+{
+    Napi::Value option = optionsObj.Get("prompt");
+    if (option.IsString())
+    {
+        prompt = option.As<Napi::String>().Utf8Value();
+        return true;
+    }
+
+    if (option.IsTypedArray() && option.As<Napi::TypedArray>().TypedArrayType() == napi_int32_array)
+    {
+        Napi::Int32Array array = option.As<Napi::Int32Array>();
+        if (array.ElementLength() > 0)
+        {
+            tokens = token_view(array.Data(), array.ElementLength());
+            return true;
+        }
+    }
+
+    Napi::TypeError::New(optionsObj.Env(), "prompt is required and should be a string or a non empty Int32Array").ThrowAsJavaScriptException();
+    return false;
+}
+
+//  KV cache types selectable per context, anything quantized needs block aligned head sizes
+const std::pair<const char *, ggml_type> CACHE_TYPES[] = {
+    {"f32", GGML_TYPE_F32},
+    {"f16", GGML_TYPE_F16},
+    {"bf16", GGML_TYPE_BF16},
+    {"q8_0", GGML_TYPE_Q8_0},
+    {"q5_1", GGML_TYPE_Q5_1},
+    {"q5_0", GGML_TYPE_Q5_0},
+    {"q4_1", GGML_TYPE_Q4_1},
+    {"q4_0", GGML_TYPE_Q4_0},
+    {"iq4_nl", GGML_TYPE_IQ4_NL},
+};
+
+//  Returns false when the option names an unknown type
+bool ParseCacheTypeOption(const Napi::Object &obj, const char *name, ggml_type &value)
+{
+    if (!obj.Has(name) || !obj.Get(name).IsString())
+    {
+        return true;
+    }
+
+    std::string type = obj.Get(name).As<Napi::String>().Utf8Value();
+    for (const auto &entry : CACHE_TYPES)
+    {
+        if (type == entry.first)
+        {
+            value = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+//  Threadpool handle given by JS, retained so it survives until the context takes its own reference
+threadpool_handle *ParseThreadpoolOption(const Napi::Object &obj, const char *name)
+{
+    if (obj.Has(name) && obj.Get(name).IsExternal())
+    {
+        return retainThreadpool(obj.Get(name).As<Napi::External<threadpool_handle>>().Data());
+    }
+    return nullptr;
+}
+
+//  Reads the optional sampling object of the inference options
+sampling_params ParseSamplingOptions(const Napi::Object &optionsObj)
+{
+    sampling_params sampling;
+
+    if (!optionsObj.Has("sampling") || !optionsObj.Get("sampling").IsObject())
+    {
+        return sampling;
+    }
+
+    Napi::Object samplingObj = optionsObj.Get("sampling").As<Napi::Object>();
+    sampling.enabled = true;
+
+    ParseNumberOption(samplingObj, "topK", sampling.topK);
+    ParseNumberOption(samplingObj, "topP", sampling.topP);
+    ParseNumberOption(samplingObj, "minP", sampling.minP);
+    ParseNumberOption(samplingObj, "typicalP", sampling.typicalP);
+    ParseNumberOption(samplingObj, "temperature", sampling.temperature);
+    ParseNumberOption(samplingObj, "dynatempRange", sampling.dynatempRange);
+    ParseNumberOption(samplingObj, "dynatempExponent", sampling.dynatempExponent);
+    ParseNumberOption(samplingObj, "xtcProbability", sampling.xtcProbability);
+    ParseNumberOption(samplingObj, "xtcThreshold", sampling.xtcThreshold);
+    ParseNumberOption(samplingObj, "penaltyLastN", sampling.penaltyLastN);
+    ParseNumberOption(samplingObj, "repeatPenalty", sampling.repeatPenalty);
+    ParseNumberOption(samplingObj, "frequencyPenalty", sampling.frequencyPenalty);
+    ParseNumberOption(samplingObj, "presencePenalty", sampling.presencePenalty);
+    ParseNumberOption(samplingObj, "dryMultiplier", sampling.dryMultiplier);
+    ParseNumberOption(samplingObj, "dryBase", sampling.dryBase);
+    ParseNumberOption(samplingObj, "dryAllowedLength", sampling.dryAllowedLength);
+    ParseNumberOption(samplingObj, "dryPenaltyLastN", sampling.dryPenaltyLastN);
+    ParseNumberOption(samplingObj, "mirostat", sampling.mirostat);
+    ParseNumberOption(samplingObj, "mirostatTau", sampling.mirostatTau);
+    ParseNumberOption(samplingObj, "mirostatEta", sampling.mirostatEta);
+
+    if (samplingObj.Has("drySequenceBreakers") && samplingObj.Get("drySequenceBreakers").IsArray())
+    {
+        Napi::Array breakers = samplingObj.Get("drySequenceBreakers").As<Napi::Array>();
+        sampling.drySequenceBreakers.clear();
+        for (uint32_t i = 0; i < breakers.Length(); i++)
+        {
+            if (breakers.Get(i).IsString())
+            {
+                sampling.drySequenceBreakers.push_back(breakers.Get(i).As<Napi::String>().Utf8Value());
+            }
+        }
+    }
+
+    //  Token id to bias map, e.g. { 151645: -100 }
+    if (samplingObj.Has("logitBias") && samplingObj.Get("logitBias").IsObject())
+    {
+        Napi::Object biasObj = samplingObj.Get("logitBias").As<Napi::Object>();
+        Napi::Array keys = biasObj.GetPropertyNames();
+        for (uint32_t i = 0; i < keys.Length(); i++)
+        {
+            Napi::Value key = keys.Get(i);
+            Napi::Value bias = biasObj.Get(key);
+            if (bias.IsNumber())
+            {
+                sampling.logitBias.push_back({static_cast<llama_token>(strtol(key.ToString().Utf8Value().c_str(), nullptr, 10)), bias.As<Napi::Number>().FloatValue()});
+            }
+        }
+    }
+
+    return sampling;
+}
+
+//  Converts a JSON schema to GBNF, walking the parsed schema object. Every subschema becomes a rule
+//  named after its path, shared JSON pieces (string, number, ...) are added once when first used.
+class schema_converter
+{
+public:
+    explicit schema_converter(const Napi::Value &root)
+        : _root(root), _json(root.Env().Global().Get("JSON").As<Napi::Object>()) {}
+
+    //  Returns an empty string and sets error when the schema uses something not supported
+    std::string convert(std::string &error)
+    {
+        //  Schemas resolving to a shared rule ({}, {type: "string"}, a $ref, ...) still need a root
+        std::string root = visit(_root, "root");
+        if (root != "root")
+        {
+            _rules["root"] = root;
+        }
+
+        if (!_error.empty())
+        {
+            error = _error;
+            return "";
+        }
+
+        std::string grammar;
+        for (const auto &rule : _rules)
+        {
+            grammar += rule.first + " ::= " + rule.second + "\n";
+        }
+        return grammar;
+    }
+
+private:
+    static std::string ruleName(const std::string &name)
+    {
+        std::string rule;
+        for (char c : name)
+        {
+            rule += isalnum(static_cast<unsigned char>(c)) ? c : '-';
+        }
+        return rule;
+    }
+
+    //  Adds a rule and returns its name, unique among the rules so far
+    std::string addRule(const std::string &name, const std::string &body)
+    {
+        std::string rule = ruleName(name);
+        std::string unique = rule;
+        for (int i = 1; _rules.count(unique) != 0 && _rules[unique] != body; i++)
+        {
+            unique = rule + std::to_string(i);
+        }
+
+        _rules[unique] = body;
+        return unique;
+    }
+
+    std::string primitive(const std::string &name)
+    {
+        static const std::map<std::string, std::pair<std::string, std::vector<std::string>>> PRIMITIVES = {
+            {"space", {"| \" \" | \"\\n\" [ \\t]{0,20}", {}}},
+            {"boolean", {"(\"true\" | \"false\") space", {"space"}}},
+            {"null", {"\"null\" space", {"space"}}},
+            {"integral-part", {"[0] | [1-9] [0-9]{0,15}", {}}},
+            {"decimal-part", {"[0-9]{1,16}", {}}},
+            {"number", {"(\"-\"? integral-part) (\".\" decimal-part)? ([eE] [-+]? integral-part)? space", {"integral-part", "decimal-part", "space"}}},
+            {"integer", {"(\"-\"? integral-part) space", {"integral-part", "space"}}},
+            {"char", {"[^\"\\\\\\x7F\\x00-\\x1F] | [\\\\] ([\"\\\\bfnrt] | \"u\" [0-9a-fA-F]{4})", {}}},
+            {"string", {"\"\\\"\" char* \"\\\"\" space", {"char", "space"}}},
+            {"value", {"object | array | string | number | boolean | null", {"object", "array", "string", "number", "boolean", "null"}}},
+            {"object", {"\"{\" space ( string \":\" space value (\",\" space string \":\" space value)* )? \"}\" space", {"string", "value", "space"}}},
+            {"array", {"\"[\" space ( value (\",\" space value)* )? \"]\" space", {"value", "space"}}},
+        };
+
+        if (_rules.count(name) == 0)
+        {
+            const auto &primitive = PRIMITIVES.at(name);
+            _rules[name] = primitive.first;
+            for (const std::string &dependency : primitive.second)
+            {
+                this->primitive(dependency);
+            }
+        }
+        return name;
+    }
+
+    //  GBNF literal matching the JSON text of value
+    std::string literal(const Napi::Value &value)
+    {
+        std::string json = _json.Get("stringify").As<Napi::Function>().Call(_json, {value}).As<Napi::String>().Utf8Value();
+        std::string out = "\"";
+        for (char c : json)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    //  Resolves local references like #/$defs/item, unknown ones resolve to undefined
+    Napi::Value resolve(const std::string &ref)
+    {
+        Napi::Value node = _root;
+        size_t pos = 1;
+        while (pos < ref.size() && node.IsObject())
+        {
+            size_t next = ref.find('/', pos + 1);
+            std::string part = ref.substr(pos + 1, next == std::string::npos ? std::string::npos : next - pos - 1);
+            node = node.As<Napi::Object>().Get(part);
+            pos = next == std::string::npos ? ref.size() : next;
+        }
+        return node;
+    }
+
+    std::string repeat(const std::string &item, const std::string &separator, uint32_t min, int64_t max)
+    {
+        if (max == 0)
+        {
+            return "";
+        }
+
+        std::string rest = "(" + separator + " " + item + ")";
+        std::string tail = max < 0 ? rest + "*" : rest + "{0," + std::to_string(max - 1) + "}";
+        if (min > 1)
+        {
+            tail = rest + "{" + std::to_string(min - 1) + (max < 0 ? "," : "," + std::to_string(max - 1)) + "}";
+        }
+        return min == 0 ? "( " + item + " " + tail + " )?" : item + " " + tail;
+    }
+
+    std::string visit(const Napi::Value &value, const std::string &name)
+    {
+        if (!_error.empty())
+        {
+            return "value";
+        }
+
+        if (!value.IsObject())
+        {
+            //  true or a missing schema takes anything, false is not useful to generate
+            return primitive("value");
+        }
+
+        Napi::Object schema = value.As<Napi::Object>();
+
+        if (schema.Has("$ref") && schema.Get("$ref").IsString())
+        {
+            std::string ref = schema.Get("$ref").As<Napi::String>().Utf8Value();
+            auto known = _refs.find(ref);
+            if (known != _refs.end())
+            {
+                return known->second;
+            }
+
+            Napi::Value target = resolve(ref);
+            if (ref.empty() || ref[0] != '#' || target.IsUndefined())
+            {
+                _error = "Unsupported JSON schema reference " + ref;
+                return "value";
+            }
+
+            //  Named after the whole pointer before visiting, so recursive schemas refer back to it and
+            //  #/$defs/a/item never shares a rule with #/$defs/b/item
+            std::string rule = ruleName("ref" + ref.substr(1));
+            for (int i = 1; _rules.count(rule) != 0; i++)
+            {
+                rule = ruleName("ref" + ref.substr(1)) + std::to_string(i);
+            }
+            _rules[rule] = "";
+            _refs[ref] = rule;
+            std::string body = visit(target, rule + "-def");
+            _rules[rule] = body;
+            return rule;
+        }
+
+        if (schema.Has("const"))
+        {
+            return addRule(name, literal(schema.Get("const")) + " " + primitive("space"));
+        }
+
+        if (schema.Has("enum") && schema.Get("enum").IsArray())
+        {
+            Napi::Array values = schema.Get("enum").As<Napi::Array>();
+            std::string body;
+            for (uint32_t i = 0; i < values.Length(); i++)
+            {
+                body += (i > 0 ? " | " : "") + literal(values.Get(i));
+            }
+            return addRule(name, "(" + body + ") " + primitive("space"));
+        }
+
+        const char *variants = schema.Has("anyOf") ? "anyOf" : schema.Has("oneOf") ? "oneOf" : nullptr;
+        if (variants != nullptr && schema.Get(variants).IsArray())
+        {
+            Napi::Array options = schema.Get(variants).As<Napi::Array>();
+            std::string body;
+            for (uint32_t i = 0; i < options.Length(); i++)
+            {
+                body += (i > 0 ? " | " : "") + visit(options.Get(i), name + "-" + std::to_string(i));
+            }
+            return addRule(name, body);
+        }
+
+        if (schema.Has("allOf") || schema.Has("pattern") || schema.Has("patternProperties"))
+        {
+            _error = "Unsupported JSON schema keyword in " + name;
+            return "value";
+        }
+
+        if (schema.Has("type") && schema.Get("type").IsArray())
+        {
+            Napi::Array types = schema.Get("type").As<Napi::Array>();
+            std::string body;
+            for (uint32_t i = 0; i < types.Length(); i++)
+            {
+                body += (i > 0 ? " | " : "") + visitType(schema, types.Get(i).ToString().Utf8Value(), name + "-" + std::to_string(i));
+            }
+            return addRule(name, body);
+        }
+
+        std::string type = schema.Has("type") ? schema.Get("type").ToString().Utf8Value() : "";
+        if (type.empty())
+        {
+            type = schema.Has("properties") ? "object" : schema.Has("items") || schema.Has("prefixItems") ? "array" : "";
+        }
+        return visitType(schema, type, name);
+    }
+
+    std::string visitType(const Napi::Object &schema, const std::string &type, const std::string &name)
+    {
+        if (type == "object")
+        {
+            return visitObject(schema, name);
+        }
+
+        if (type == "array")
+        {
+            return visitArray(schema, name);
+        }
+
+        if (type == "string" && (schema.Has("minLength") || schema.Has("maxLength")))
+        {
+            uint32_t min = schema.Has("minLength") ? schema.Get("minLength").ToNumber().Uint32Value() : 0;
+            std::string max = schema.Has("maxLength") ? std::to_string(schema.Get("maxLength").ToNumber().Uint32Value()) : "";
+            return addRule(name, "\"\\\"\" " + primitive("char") + "{" + std::to_string(min) + "," + max + "} \"\\\"\" " + primitive("space"));
+        }
+
+        if (type == "string" || type == "number" || type == "integer" || type == "boolean" || type == "null")
+        {
+            return primitive(type);
+        }
+
+        if (!type.empty())
+        {
+            _error = "Unsupported JSON schema type " + type;
+        }
+        return primitive("value");
+    }
+
+    std::string visitObject(const Napi::Object &schema, const std::string &name)
+    {
+        const std::string space = primitive("space");
+
+        if (!schema.Has("properties") || !schema.Get("properties").IsObject())
+        {
+            //  Free form object, or a map when additionalProperties gives the value schema
+            if (!schema.Has("additionalProperties") || !schema.Get("additionalProperties").IsObject())
+            {
+                return primitive("object");
+            }
+
+            std::string entry = primitive("string") + " \":\" " + space + " " + visit(schema.Get("additionalProperties"), name + "-value");
+            return addRule(name, "\"{\" " + space + " " + repeat(entry, "\",\" " + space, 0, -1) + " \"}\" " + space);
+        }
+
+        Napi::Object properties = schema.Get("properties").As<Napi::Object>();
+        std::set<std::string> required;
+        if (schema.Has("required") && schema.Get("required").IsArray())
+        {
+            Napi::Array names = schema.Get("required").As<Napi::Array>();
+            for (uint32_t i = 0; i < names.Length(); i++)
+            {
+                required.insert(names.Get(i).ToString().Utf8Value());
+            }
+        }
+
+        //  Required properties come first in schema order, then any subset of the optional ones
+        std::vector<std::string> mandatory, optional;
+        Napi::Array keys = properties.GetPropertyNames();
+        for (uint32_t i = 0; i < keys.Length(); i++)
+        {
+            std::string key = keys.Get(i).ToString().Utf8Value();
+            std::string value = visit(properties.Get(key), name + "-" + key);
+            std::string rule = addRule(name + "-" + key + "-kv", literal(keys.Get(i)) + " " + space + " \":\" " + space + " " + value);
+            (required.count(key) != 0 ? mandatory : optional).push_back(rule);
+        }
+
+        const std::string comma = "\",\" " + space + " ";
+        std::string body;
+        for (size_t i = 0; i < mandatory.size(); i++)
+        {
+            body += (i > 0 ? " " + comma : "") + mandatory[i];
+        }
+
+        if (!mandatory.empty())
+        {
+            for (const std::string &rule : optional)
+            {
+                body += " (" + comma + rule + ")?";
+            }
+        }
+        else if (!optional.empty())
+        {
+            //  Whichever optional property comes first goes without a comma
+            std::string alternatives;
+            for (size_t i = 0; i < optional.size(); i++)
+            {
+                alternatives += (i > 0 ? " | " : "") + optional[i];
+                for (size_t j = i + 1; j < optional.size(); j++)
+                {
+                    alternatives += " (" + comma + optional[j] + ")?";
+                }
+            }
+            body = "(" + alternatives + ")?";
+        }
+
+        return addRule(name, "\"{\" " + space + " " + body + " \"}\" " + space);
+    }
+
+    std::string visitArray(const Napi::Object &schema, const std::string &name)
+    {
+        const std::string space = primitive("space");
+        const std::string comma = "\",\" " + space;
+
+        //  Tuples list a schema per position
+        Napi::Value tuple = schema.Has("prefixItems") ? schema.Get("prefixItems") : schema.Get("items");
+        if (tuple.IsArray())
+        {
+            Napi::Array items = tuple.As<Napi::Array>();
+            std::string body;
+            for (uint32_t i = 0; i < items.Length(); i++)
+            {
+                body += (i > 0 ? " " + comma + " " : "") + visit(items.Get(i), name + "-" + std::to_string(i));
+            }
+            return addRule(name, "\"[\" " + space + " " + body + " \"]\" " + space);
+        }
+
+        uint32_t min = schema.Has("minItems") ? schema.Get("minItems").ToNumber().Uint32Value() : 0;
+        int64_t max = schema.Has("maxItems") ? schema.Get("maxItems").ToNumber().Int64Value() : -1;
+        std::string item = visit(schema.Get("items"), name + "-item");
+        return addRule(name, "\"[\" " + space + " " + repeat(item, comma, min, max) + " \"]\" " + space);
+    }
+
+    Napi::Value _root;
+    Napi::Object _json;
+    std::map<std::string, std::string> _rules;
+    std::map<std::string, std::string> _refs;
+    std::string _error;
+};
+
+//  Reads the grammar or jsonSchema option into the sampling parameters, with a model the grammar gets
+//  parsed (and cached) right away so mistakes are reported to the caller. Returns false after throwing.
+bool ParseGrammarOptions(const Napi::Object &optionsObj, const llama_model *model, sampling_params &sampling)
+{
+    Napi::Env env = optionsObj.Env();
+
+    if (optionsObj.Has("grammar") && optionsObj.Get("grammar").IsString())
+    {
+        sampling.grammar = optionsObj.Get("grammar").As<Napi::String>().Utf8Value();
+    }
+    else if (optionsObj.Has("jsonSchema") && (optionsObj.Get("jsonSchema").IsObject() || optionsObj.Get("jsonSchema").IsBoolean()))
+    {
+        if (!optionsObj.Get("jsonSchema").ToBoolean().Value())
+        {
+            Napi::TypeError::New(env, "JSON schema false matches nothing").ThrowAsJavaScriptException();
+            return false;
+        }
+
+        std::string error;
+        sampling.grammar = schema_converter(optionsObj.Get("jsonSchema")).convert(error);
+        if (!error.empty())
+        {
+            Napi::TypeError::New(env, error).ThrowAsJavaScriptException();
+            return false;
+        }
+    }
+
+    if (!sampling.grammar.empty() && model != nullptr && !g_grammars.acquire(model, sampling.grammar))
+    {
+        Napi::TypeError::New(env, "Failed to parse the grammar").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
+}
+
+struct RunInferenceOptions
+{
+    std::string modelPath;
+    std::string prompt;
+    token_view promptTokens;
+    std::string systemPrompt;
+    int maxTokens = 1024;
+    int threads = 1;
+    size_t seed = LLAMA_DEFAULT_SEED;
+    int nCtx = 0;
+    bool flashAttention = true;
+    sampling_params sampling;
+    Napi::FunctionReference callback;
+};
+
+RunInferenceOptions ParseRunInferenceOptions(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsObject())
+    {
+        Napi::TypeError::New(env, "Expected an options object").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    Napi::Object optionsObj = info[0].As<Napi::Object>();
+    RunInferenceOptions options;
+
+    if (optionsObj.Has("modelPath") && optionsObj.Get("modelPath").IsString())
+    {
+        options.modelPath = optionsObj.Get("modelPath").As<Napi::String>().Utf8Value();
+    }
+    else
+    {
+        Napi::TypeError::New(env, "modelPath is required and should be a string").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    if (!ParsePromptOption(optionsObj, options.prompt, options.promptTokens))
+    {
+        return {};
+    }
+
+    //  The model is not loaded yet, ids past its vocabulary are caught once it is
+    for (size_t i = 0; i < options.promptTokens.size(); i++)
+    {
+        if (options.promptTokens[i] < 0)
+        {
+            Napi::TypeError::New(env, "Prompt token id out of range").ThrowAsJavaScriptException();
+            return {};
+        }
+    }
+
+    if (optionsObj.Has("systemPrompt") && optionsObj.Get("systemPrompt").IsString())
+    {
+        options.systemPrompt = optionsObj.Get("systemPrompt").As<Napi::String>().Utf8Value();
+    }
+
+    if (optionsObj.Has("maxTokens") && optionsObj.Get("maxTokens").IsNumber())
+    {
+        options.maxTokens = optionsObj.Get("maxTokens").As<Napi::Number>().Int32Value();
+    }
+
+    ParseThreadsOption(optionsObj, "threads", options.threads);
+
+    if (optionsObj.Has("seed") && optionsObj.Get("seed").IsNumber())
+    {
+        options.seed = optionsObj.Get("seed").As<Napi::Number>().Uint32Value();
+    }
+
+    if (optionsObj.Has("nCtx") && optionsObj.Get("nCtx").IsNumber())
+    {
+        options.nCtx = optionsObj.Get("nCtx").As<Napi::Number>().Int32Value();
+    }
+
+    if (optionsObj.Has("flashAttention") && optionsObj.Get("flashAttention").IsBoolean())
+    {
+        options.flashAttention = optionsObj.Get("flashAttention").As<Napi::Boolean>().Value();
+    }
+
+    if (optionsObj.Has("onStream") && optionsObj.Get("onStream").IsFunction())
+    {
+        options.callback = Napi::Persistent(optionsObj.Get("onStream").As<Napi::Function>());
+    }
+
+    options.sampling = ParseSamplingOptions(optionsObj);
+    if (!ParseGrammarOptions(optionsObj, nullptr, options.sampling))
+    {
+        return {};
+    }
+
+    return options;
+}
+
+Napi::Value RunInference(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    RunInferenceOptions options = ParseRunInferenceOptions(info);
+    if (env.IsExceptionPending())
+    {
+        return env.Undefined();
+    }
+
+    stream_callback_info streamInfo;
+    streamInfo.callback = [](const char *text, size_t length, llama_token token, bool done, void *data)
+    {
+        auto callback = static_cast<Napi::FunctionReference *>(data);
+        auto env = callback->Env();
+        Napi::HandleScope scope(env);
+        callback->Call({Napi::String::New(env, text, length), Napi::Boolean::New(env, done)});
+    };
+    streamInfo.data = &options.callback;
+
+    std::string response;
+
+    llama_model *model = loadModel(options.modelPath);
+    if (model != nullptr && !tokensInVocab(model, options.promptTokens))
+    {
+        releaseModel(model);
+        Napi::TypeError::New(env, "Prompt token id out of range").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    if (model != nullptr)
+    {
+        context_handle *ctx = createContext(model, options.threads, options.nCtx, options.flashAttention);
+        if (ctx != nullptr)
+        {
+            if (options.promptTokens.empty())
+            {
+                response = runInference(model, ctx, options.systemPrompt, options.prompt, options.maxTokens, options.seed, options.sampling, (options.callback.IsEmpty() ? nullptr : &streamInfo));
+            }
+            else
+            {
+                response = runInferenceTokens(model, ctx, options.promptTokens, options.maxTokens, options.seed, options.sampling, (options.callback.IsEmpty() ? nullptr : &streamInfo));
+            }
+            releaseContext(ctx);
+        }
+        releaseModel(model);
+    }
+
+    return Napi::String::New(env, response);
+}
+
+Napi::Value GetModelToken(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsExternal() || !info[1].IsString())
+    {
+        Napi::TypeError::New(env, "Model handle expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    llama_model *model = info[0].As<Napi::External<llama_model>>().Data();
+    if (!model)
+    {
+        Napi::TypeError::New(env, "Invalid model handle").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    std::string token_name = info[1].As<Napi::String>().Utf8Value();
+    if (token_name.length() < 1)
+    {
+        Napi::TypeError::New(env, "Token name expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    llama_token token = -1;
+
+    if (token_name == "BOS")
+    {
+        token = llama_token_bos(model);
+    }
+    else if (token_name == "EOS")
+    {
+        token = llama_token_eos(model);
+    }
+    else if (token_name == "PAD")
+    {
         token = llama_token_pad(model);
     }
-    else if (token_name == "EOT")
+    else if (token_name == "EOT")
+    {
+        token = llama_token_eot(model);
+    }
+    else if (token_name == "SEP")
+    {
+        token = llama_token_sep(model);
+    }
+    else if (token_name == "CLS")
+    {
+        token = llama_token_cls(model);
+    }
+    else if (token_name == "NL")
+    {
+        token = llama_token_nl(model);
+    }
+    else
+    {
+        Napi::TypeError::New(env, "Unknown token type").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    const char *tokenValue = token > 0 ? llama_token_get_text(model, token) : nullptr;
+    return tokenValue == nullptr ? env.Undefined() : Napi::String::New(env, tokenValue);
+}
+
+Napi::Value CreateChat(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    chat_session *chat = new chat_session();
+
+    if (info.Length() > 0 && info[0].IsObject())
+    {
+        Napi::Object optionsObj = info[0].As<Napi::Object>();
+
+        if (optionsObj.Has("template") && optionsObj.Get("template").IsString())
+        {
+            chat->tmpl = optionsObj.Get("template").As<Napi::String>().Utf8Value();
+        }
+
+        if (optionsObj.Has("systemPrompt") && optionsObj.Get("systemPrompt").IsString())
+        {
+            std::string system_prompt = optionsObj.Get("systemPrompt").As<Napi::String>().Utf8Value();
+            if (!system_prompt.empty())
+            {
+                chat->messages.push_back({"system", system_prompt});
+            }
+        }
+    }
+
+    //  Freed once JS lets go of the handle
+    return Napi::External<chat_session>::New(env, chat, [](Napi::Env, chat_session *chat)
+                                             { delete chat; });
+}
+
+Napi::Value GetChatHistory(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsExternal())
+    {
+        Napi::TypeError::New(env, "Chat handle expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    chat_session *chat = info[0].As<Napi::External<chat_session>>().Data();
+
+    std::lock_guard<std::mutex> lock(chat->mutex);
+    Napi::Array history = Napi::Array::New(env, chat->messages.size());
+    for (size_t i = 0; i < chat->messages.size(); i++)
+    {
+        Napi::Object message = Napi::Object::New(env);
+        message.Set("role", chat->messages[i].role);
+        message.Set("content", chat->messages[i].content);
+        history.Set(i, message);
+    }
+
+    return history;
+}
+
+Napi::Value GetContextInfo(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsExternal())
+    {
+        Napi::TypeError::New(env, "Context handle expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    context_handle *handle = info[0].As<Napi::External<context_handle>>().Data();
+
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("nCtx", Napi::Number::New(env, llama_n_ctx(handle->ctx)));
+    result.Set("typeK", ggml_type_name(handle->type_k));
+    result.Set("typeV", ggml_type_name(handle->type_v));
+    result.Set("kvSize", Napi::Number::New(env, static_cast<double>(handle->kv_size.load())));
+    result.Set("kvSizeMax", Napi::Number::New(env, static_cast<double>(handle->kv_size_max)));
+    return result;
+}
+
+//  Nodes the weights of a model were placed on, empty unless it was loaded with the "distribute" strategy
+Napi::Value GetNumaLayout(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsExternal())
+    {
+        Napi::TypeError::New(env, "Model handle expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    llama_model *model = info[0].As<Napi::External<llama_model>>().Data();
+    if (!model)
+    {
+        Napi::TypeError::New(env, "Invalid model handle").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    const int nNodes = llama_model_numa_layout(model, nullptr, 0);
+    std::vector<size_t> nodeBytes(nNodes);
+    llama_model_numa_layout(model, nodeBytes.data(), nNodes);
+
+    Napi::Array result = Napi::Array::New(env, nNodes);
+    for (int n = 0; n < nNodes; n++)
+    {
+        std::vector<uint32_t> cpus(GGML_MAX_N_THREADS);
+        const int nCpus = std::min<int>(GGML_MAX_N_THREADS, ggml_numa_node_cpus(n, cpus.data(), GGML_MAX_N_THREADS));
+
+        Napi::Array cpuList = Napi::Array::New(env, nCpus);
+        for (int i = 0; i < nCpus; i++)
+        {
+            cpuList.Set(static_cast<uint32_t>(i), Napi::Number::New(env, cpus[i]));
+        }
+
+        Napi::Object node = Napi::Object::New(env);
+        node.Set("node", Napi::Number::New(env, n));
+        node.Set("cpus", cpuList);
+        node.Set("weightBytes", Napi::Number::New(env, static_cast<double>(nodeBytes[n])));
+        result.Set(static_cast<uint32_t>(n), node);
+    }
+    return result;
+}
+
+Napi::Value CreateThreadpool(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsObject())
+    {
+        Napi::TypeError::New(env, "Expected an options object").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    Napi::Object optionsObj = info[0].As<Napi::Object>();
+
+    int threads = 0;
+    ParseNumberOption(optionsObj, "threads", threads);
+    if (threads < 1 || threads > GGML_MAX_N_THREADS)
+    {
+        Napi::TypeError::New(env, "threads is required and should be a positive number").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    ggml_threadpool_params params = ggml_threadpool_params_default(threads);
+
+    //  Either a hex mask ("0xff00") or a list of cpu indices
+    if (optionsObj.Has("cpumask") && optionsObj.Get("cpumask").IsString())
+    {
+        std::string mask = optionsObj.Get("cpumask").As<Napi::String>().Utf8Value();
+        if (mask.size() > 2 && mask[0] == '0' && (mask[1] == 'x' || mask[1] == 'X'))
+        {
+            mask = mask.substr(2);
+        }
+
+        int cpu = 0;
+        for (auto it = mask.rbegin(); it != mask.rend() && cpu < GGML_MAX_N_THREADS; ++it)
+        {
+            char digit[2] = {*it, 0};
+            char *end = nullptr;
+            long bits = strtol(digit, &end, 16);
+            if (*end != 0)
+            {
+                Napi::TypeError::New(env, "cpumask should be a hex string").ThrowAsJavaScriptException();
+                return env.Undefined();
+            }
+
+            for (int bit = 0; bit < 4 && cpu < GGML_MAX_N_THREADS; bit++, cpu++)
+            {
+                params.cpumask[cpu] = (bits >> bit) & 1;
+            }
+        }
+    }
+    else if (optionsObj.Has("cpumask") && optionsObj.Get("cpumask").IsArray())
+    {
+        Napi::Array cpus = optionsObj.Get("cpumask").As<Napi::Array>();
+        for (uint32_t i = 0; i < cpus.Length(); i++)
+        {
+            if (!cpus.Get(i).IsNumber())
+            {
+                Napi::TypeError::New(env, "cpumask should be a list of cpu indices").ThrowAsJavaScriptException();
+                return env.Undefined();
+            }
+
+            int cpu = cpus.Get(i).As<Napi::Number>().Int32Value();
+            if (cpu >= 0 && cpu < GGML_MAX_N_THREADS)
+            {
+                params.cpumask[cpu] = true;
+            }
+        }
+    }
+
+    if (optionsObj.Has("priority") && optionsObj.Get("priority").IsString())
+    {
+        std::string priority = optionsObj.Get("priority").As<Napi::String>().Utf8Value();
+        if (priority == "normal")
+        {
+            params.prio = GGML_SCHED_PRIO_NORMAL;
+        }
+        else if (priority == "medium")
+        {
+            params.prio = GGML_SCHED_PRIO_MEDIUM;
+        }
+        else if (priority == "high")
+        {
+            params.prio = GGML_SCHED_PRIO_HIGH;
+        }
+        else if (priority == "realtime")
+        {
+            params.prio = GGML_SCHED_PRIO_REALTIME;
+        }
+        else
+        {
+            Napi::TypeError::New(env, "Unknown priority").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+    }
+
+    int poll = params.poll;
+    ParseNumberOption(optionsObj, "poll", poll);
+    params.poll = std::min(std::max(poll, 0), 100);
+
+    if (optionsObj.Has("strictCpu") && optionsObj.Get("strictCpu").IsBoolean())
+    {
+        params.strict_cpu = optionsObj.Get("strictCpu").As<Napi::Boolean>().Value();
+    }
+
+    threadpool_handle *threadpool = createThreadpool(params);
+    if (threadpool == nullptr)
+    {
+        Napi::Error::New(env, "Failed to create threadpool").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    //  Contexts hold their own references, the pool goes away with the last of them
+    return Napi::External<threadpool_handle>::New(env, threadpool, [](Napi::Env, threadpool_handle *threadpool)
+                                                  { releaseThreadpool(threadpool); });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// ASYNC
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//  Drop-in for Napi::AsyncWorker and AsyncProgressWorkerBase<void>. Execute runs on the worker pool,
+//  progress and completion come back through a threadsafe function and the worker deletes itself after
+//  OnOK or OnError, like the Napi ones.
+class PoolWorker
+{
+public:
+    virtual ~PoolWorker() = default;
+
+    void Queue()
+    {
+        //  Created here rather than in the constructor, a worker dropped before queueing holds no loop reference
+        _tsfn = Napi::ThreadSafeFunction::New(_env, Napi::Function::New(_env, [](const Napi::CallbackInfo &) {}), _name, 0, 1);
+
+        worker_pool::instance().submit([this]
+                                       {
+            //  Like Napi::AsyncWorker, a throwing Execute fails the call instead of the process
+            try
+            {
+                Execute();
+            }
+            catch (const std::exception &e)
+            {
+                SetError(e.what());
+            }
+
+            //  The worker is gone once the completion runs, keep the function alive to release it
+            Napi::ThreadSafeFunction tsfn = _tsfn;
+            tsfn.NonBlockingCall(this, [](Napi::Env, Napi::Function, PoolWorker *self)
+                                 { self->complete(); });
+            tsfn.Release(); });
+    }
+
+    Napi::Env Env() const
+    {
+        return _env;
+    }
+
+protected:
+    PoolWorker(Napi::Env env, const char *name)
+        : _env(env), _name(name) {}
+
+    PoolWorker(const Napi::Function &callback, const char *name)
+        : PoolWorker(callback.Env(), name)
+    {
+        _callback = Napi::Persistent(callback);
+    }
+
+    virtual void Execute() = 0;
+    virtual void OnOK() = 0;
+    virtual void OnError(const Napi::Error &error) = 0;
+    virtual void OnWorkProgress(void *) {}
+
+    void SetError(const std::string &error)
+    {
+        _error = error;
+    }
+
+    Napi::FunctionReference &Callback()
+    {
+        return _callback;
+    }
+
+    //  Worker thread only, OnWorkProgress runs once for every call so callers coalesce them
+    napi_status NonBlockingCall(void *data)
+    {
+        return _tsfn.NonBlockingCall(this, [data](Napi::Env, Napi::Function, PoolWorker *self)
+                                     { self->OnWorkProgress(data); });
+    }
+
+private:
+    void complete()
+    {
+        Napi::HandleScope scope(_env);
+        if (_error.empty())
+        {
+            OnOK();
+        }
+        else
+        {
+            OnError(Napi::Error::New(_env, _error));
+        }
+        delete this;
+    }
+
+    Napi::Env _env;
+    const char *_name;
+    Napi::ThreadSafeFunction _tsfn;
+    Napi::FunctionReference _callback;
+    std::string _error;
+};
+
+//  Load progress is coalesced like streamed text, JS gets the latest fraction whenever it gets to run
+class LoadModelWorker : public PoolWorker
+{
+public:
+    LoadModelWorker(Napi::Env &env, const std::string &modelPath, const model_load_options &options, const Napi::Function &onProgress)
+        : PoolWorker(env, "LoadModelWorker"),
+          _modelPath(modelPath),
+          _options(options),
+          _deferred(Napi::Promise::Deferred::New(env))
+    {
+        if (!onProgress.IsEmpty())
+        {
+            _onProgress = Napi::Persistent(onProgress);
+        }
+    }
+
+    void Execute() override
+    {
+        if (!initNuma(_options.numa))
+        {
+            SetError("NUMA strategy is process wide and already set to another one");
+            return;
+        }
+
+        _model = _onProgress.IsEmpty() ? loadModel(_modelPath, _options) : loadModel(_modelPath, _options, progress, this);
+
+        if (_model == nullptr)
+        {
+            SetError("Failed to load model");
+        }
+    }
+
+    void OnWorkProgress(void *) override
+    {
+        Napi::HandleScope scope(Env());
+        _progressPending.store(false, std::memory_order_release);
+        report(_progress.load(std::memory_order_relaxed));
+    }
+
+    void OnOK() override
+    {
+        Napi::Env env = _deferred.Env();
+        Napi::HandleScope scope(env);
+
+        //  Cached models load without any progress, every listener still sees the end
+        report(1.0f);
+
+        // Wrap the model pointer in an external
+        Napi::External<llama_model> modelExternal = Napi::External<llama_model>::New(env, _model);
+        _deferred.Resolve(modelExternal);
+    }
+
+    void OnError(const Napi::Error &error) override
+    {
+        _deferred.Reject(error.Value());
+    }
+
+    Napi::Promise GetPromise() const
+    {
+        return _deferred.Promise();
+    }
+
+private:
+    static bool progress(float value, void *data)
+    {
+        auto *self = static_cast<LoadModelWorker *>(data);
+        self->_progress.store(value, std::memory_order_relaxed);
+        if (!self->_progressPending.exchange(true, std::memory_order_acq_rel))
+        {
+            self->NonBlockingCall(nullptr);
+        }
+        return true;
+    }
+
+    void report(float value)
+    {
+        if (_onProgress.IsEmpty() || value <= _progressSent)
+        {
+            return;
+        }
+
+        _progressSent = value;
+        _onProgress.Call({Napi::Number::New(Env(), value)});
+    }
+
+    std::string _modelPath;
+    model_load_options _options;
+    llama_model *_model = nullptr;
+    Napi::Promise::Deferred _deferred;
+
+    Napi::FunctionReference _onProgress;
+    std::atomic<float> _progress{0.0f};
+    std::atomic<bool> _progressPending{false};
+    float _progressSent = 0.0f; // JS thread only
+};
+
+//  NUMA strategies by name, "numactl" keeps the cpus and nodes the process was started with
+const std::pair<const char *, ggml_numa_strategy> NUMA_STRATEGIES[] = {
+    {"disabled", GGML_NUMA_STRATEGY_DISABLED},
+    {"distribute", GGML_NUMA_STRATEGY_DISTRIBUTE},
+    {"isolate", GGML_NUMA_STRATEGY_ISOLATE},
+    {"numactl", GGML_NUMA_STRATEGY_NUMACTL},
+    {"mirror", GGML_NUMA_STRATEGY_MIRROR},
+};
+
+//  Returns false (with a JS exception pending) for options that cannot be used
+bool ParseLoadModelOptions(const Napi::Object &optionsObj, model_load_options &options, Napi::Function &onProgress)
+{
+    Napi::Env env = optionsObj.Env();
+
+    if (optionsObj.Has("useMmap") && optionsObj.Get("useMmap").IsBoolean())
+    {
+        options.useMmap = optionsObj.Get("useMmap").As<Napi::Boolean>().Value();
+    }
+
+    if (optionsObj.Has("useMlock") && optionsObj.Get("useMlock").IsBoolean())
+    {
+        options.useMlock = optionsObj.Get("useMlock").As<Napi::Boolean>().Value();
+    }
+
+    if (optionsObj.Has("prefetch") && optionsObj.Get("prefetch").IsBoolean())
+    {
+        options.prefetch = optionsObj.Get("prefetch").As<Napi::Boolean>().Value();
+    }
+
+    if (optionsObj.Has("numaPlace") && optionsObj.Get("numaPlace").IsBoolean())
+    {
+        options.numaPlace = optionsObj.Get("numaPlace").As<Napi::Boolean>().Value();
+    }
+
+    if (optionsObj.Has("threads") && optionsObj.Get("threads").IsNumber())
+    {
+        options.threads = std::max(1, optionsObj.Get("threads").As<Napi::Number>().Int32Value());
+    }
+
+    if (optionsObj.Has("numa") && optionsObj.Get("numa").IsString())
+    {
+        std::string numa = optionsObj.Get("numa").As<Napi::String>().Utf8Value();
+        auto it = std::find_if(std::begin(NUMA_STRATEGIES), std::end(NUMA_STRATEGIES), [&numa](const std::pair<const char *, ggml_numa_strategy> &entry)
+                               { return numa == entry.first; });
+        if (it == std::end(NUMA_STRATEGIES))
+        {
+            Napi::TypeError::New(env, "Unknown NUMA strategy").ThrowAsJavaScriptException();
+            return false;
+        }
+        options.numa = it->second;
+    }
+
+    if (optionsObj.Has("onProgress") && optionsObj.Get("onProgress").IsFunction())
+    {
+        onProgress = optionsObj.Get("onProgress").As<Napi::Function>();
+    }
+
+    return true;
+}
+
+Napi::Value LoadModelAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsString())
+    {
+        Napi::TypeError::New(env, "Model path expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    std::string modelPath = info[0].As<Napi::String>().Utf8Value();
+
+    model_load_options options;
+    Napi::Function onProgress;
+    if (info.Length() > 1 && info[1].IsObject() && !ParseLoadModelOptions(info[1].As<Napi::Object>(), options, onProgress))
+    {
+        return env.Undefined();
+    }
+
+    LoadModelWorker *worker = new LoadModelWorker(env, modelPath, options, onProgress);
+    worker->Queue();
+
+    return worker->GetPromise();
+}
+
+class CreateContextWorker : public PoolWorker
+{
+public:
+    //  Takes over the references to the threadpools
+    CreateContextWorker(Napi::Env &env, llama_model *model, const llama_context_params &ctx_params,
+                        threadpool_handle *threadpool = nullptr, threadpool_handle *threadpoolBatch = nullptr)
+        : PoolWorker(env, "CreateContextWorker"), _model(model), _ctx_params(ctx_params), _threadpool(threadpool),
+          _threadpoolBatch(threadpoolBatch), _deferred(Napi::Promise::Deferred::New(env)) {}
+
+    ~CreateContextWorker()
+    {
+        releaseThreadpool(_threadpool);
+        releaseThreadpool(_threadpoolBatch);
+    }
+
+    void Execute() override
+    {
+        _context = createContext(_model, _ctx_params, _threadpool, _threadpoolBatch);
+        if (_context == nullptr)
+        {
+            SetError("Failed to create context");
+        }
+    }
+
+    void OnOK() override
+    {
+        Napi::Env env = _deferred.Env();
+        Napi::External<context_handle> contextExternal = Napi::External<context_handle>::New(env, _context);
+        _deferred.Resolve(contextExternal);
+    }
+
+    void OnError(const Napi::Error &error) override
+    {
+        _deferred.Reject(error.Value());
+    }
+
+    Napi::Promise GetPromise() const
+    {
+        return _deferred.Promise();
+    }
+
+private:
+    llama_model *_model;
+    context_handle *_context;
+    llama_context_params _ctx_params;
+    threadpool_handle *_threadpool;
+    threadpool_handle *_threadpoolBatch;
+    Napi::Promise::Deferred _deferred;
+};
+
+struct CreateContextOptions
+{
+    llama_model *model;
+    int threads = 1;
+    int nCtx = 0;
+    bool flashAttention = true;
+    ggml_type typeK = GGML_TYPE_F16;
+    ggml_type typeV = GGML_TYPE_F16;
+    int threadsBatch = 0; // 0 means same as threads
+    threadpool_handle *threadpool = nullptr;
+    threadpool_handle *threadpoolBatch = nullptr;
+    int maxSequences = 1;
+    int batchSize = 0;
+    int nCtxInit = -1; // negative keeps the default
+    enum llama_pooling_type pooling = LLAMA_POOLING_TYPE_UNSPECIFIED;
+};
+
+CreateContextOptions ParseCreateContextOptions(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsObject())
+    {
+        Napi::TypeError::New(env, "Expected an options object").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    Napi::Object optionsObj = info[0].As<Napi::Object>();
+    CreateContextOptions options;
+
+    if (optionsObj.Has("model") && optionsObj.Get("model").IsExternal())
+    {
+        options.model = optionsObj.Get("model").As<Napi::External<llama_model>>().Data();
+    }
+    else
+    {
+        Napi::TypeError::New(env, "model is required and should be an external").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    ParseThreadsOption(optionsObj, "threads", options.threads);
+    ParseThreadsOption(optionsObj, "threadsBatch", options.threadsBatch);
+
+    if (optionsObj.Has("nCtx") && optionsObj.Get("nCtx").IsNumber())
+    {
+        options.nCtx = optionsObj.Get("nCtx").As<Napi::Number>().Int32Value();
+    }
+
+    if (optionsObj.Has("flashAttention") && optionsObj.Get("flashAttention").IsBoolean())
+    {
+        options.flashAttention = optionsObj.Get("flashAttention").As<Napi::Boolean>().Value();
+    }
+
+    if (!ParseCacheTypeOption(optionsObj, "typeK", options.typeK) || !ParseCacheTypeOption(optionsObj, "typeV", options.typeV))
+    {
+        Napi::TypeError::New(env, "Unknown KV cache type").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    //  Quantized V is only read by the flash attention kernel
+    if (ggml_is_quantized(options.typeV) && !options.flashAttention)
+    {
+        Napi::TypeError::New(env, "Quantized typeV requires flashAttention").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    if (optionsObj.Has("maxSequences") && optionsObj.Get("maxSequences").IsNumber())
+    {
+        options.maxSequences = optionsObj.Get("maxSequences").As<Napi::Number>().Int32Value();
+    }
+
+    if (optionsObj.Has("batchSize") && optionsObj.Get("batchSize").IsNumber())
+    {
+        options.batchSize = optionsObj.Get("batchSize").As<Napi::Number>().Int32Value();
+    }
+
+    if (optionsObj.Has("nCtxInit") && optionsObj.Get("nCtxInit").IsNumber())
+    {
+        options.nCtxInit = optionsObj.Get("nCtxInit").As<Napi::Number>().Int32Value();
+    }
+
+    if (optionsObj.Has("pooling") && optionsObj.Get("pooling").IsString())
+    {
+        std::string pooling = optionsObj.Get("pooling").As<Napi::String>().Utf8Value();
+        if (pooling == "none")
+        {
+            options.pooling = LLAMA_POOLING_TYPE_NONE;
+        }
+        else if (pooling == "mean")
+        {
+            options.pooling = LLAMA_POOLING_TYPE_MEAN;
+        }
+        else if (pooling == "cls")
+        {
+            options.pooling = LLAMA_POOLING_TYPE_CLS;
+        }
+        else if (pooling == "last")
+        {
+            options.pooling = LLAMA_POOLING_TYPE_LAST;
+        }
+        else if (pooling == "rank")
+        {
+            options.pooling = LLAMA_POOLING_TYPE_RANK;
+        }
+        else
+        {
+            Napi::TypeError::New(env, "Unknown pooling type").ThrowAsJavaScriptException();
+            return {};
+        }
+    }
+
+    //  Last, nothing can fail after the threadpools are retained
+    options.threadpool = ParseThreadpoolOption(optionsObj, "threadpool");
+    options.threadpoolBatch = ParseThreadpoolOption(optionsObj, "threadpoolBatch");
+
+    return options;
+}
+
+Napi::Value CreateContextAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    CreateContextOptions options = ParseCreateContextOptions(info);
+
+    if (options.model == nullptr)
+    {
+        Napi::TypeError::New(env, "Invalid model handle").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    if (options.maxSequences < 1 || options.batchSize < 0)
+    {
+        releaseThreadpool(options.threadpool);
+        releaseThreadpool(options.threadpoolBatch);
+        Napi::TypeError::New(env, "Invalid options object").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    llama_context_params ctx_params = buildContextParams(options.threads, options.nCtx, options.flashAttention);
+    ctx_params.type_k = options.typeK;
+    ctx_params.type_v = options.typeV;
+    if (options.threadsBatch != 0)
+    {
+        ctx_params.n_threads_batch = options.threadsBatch;
+    }
+    ctx_params.n_seq_max = options.maxSequences;
+    ctx_params.pooling_type = options.pooling;
+    if (options.nCtxInit >= 0)
+    {
+        ctx_params.n_ctx_init = options.nCtxInit;
+    }
+    if (options.batchSize > 0)
+    {
+        ctx_params.n_batch = options.batchSize;
+        ctx_params.n_ubatch = options.batchSize;
+    }
+
+    CreateContextWorker *worker = new CreateContextWorker(env, options.model, ctx_params, options.threadpool, options.threadpoolBatch);
+    worker->Queue();
+
+    return worker->GetPromise();
+}
+
+//  Single producer single consumer ring buffer, the inference thread writes and the JS thread drains
+template <typename T>
+class spsc_ring
+{
+public:
+    explicit spsc_ring(size_t capacity) : _buffer(capacity) {}
+
+    //  Producer side, returns how many items fit
+    size_t write(const T *data, size_t count)
+    {
+        const size_t head = _head.load(std::memory_order_relaxed);
+        const size_t tail = _tail.load(std::memory_order_acquire);
+        const size_t n = std::min(count, _buffer.size() - (head - tail));
+
+        for (size_t i = 0; i < n; i++)
+        {
+            _buffer[(head + i) % _buffer.size()] = data[i];
+        }
+
+        _head.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    //  Consumer side, appends up to max_count items to out
+    template <typename Container>
+    size_t read(Container &out, size_t max_count = SIZE_MAX)
+    {
+        const size_t tail = _tail.load(std::memory_order_relaxed);
+        const size_t head = _head.load(std::memory_order_acquire);
+        const size_t n = std::min(max_count, head - tail);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            out.push_back(_buffer[(tail + i) % _buffer.size()]);
+        }
+
+        _tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    //  Consumer side, looks at the item at offset without consuming it
+    T peek(size_t offset) const
+    {
+        return _buffer[(_tail.load(std::memory_order_relaxed) + offset) % _buffer.size()];
+    }
+
+    size_t size() const
+    {
+        return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> _buffer;
+    std::atomic<size_t> _head{0};
+    std::atomic<size_t> _tail{0};
+};
+
+//  Length of the longest prefix of the ring not ending in the middle of a UTF-8 sequence
+size_t utf8CompleteLength(const spsc_ring<char> &ring, size_t length)
+{
+    for (size_t back = 1; back <= 4 && back <= length; back++)
+    {
+        unsigned char c = ring.peek(length - back);
+        if ((c & 0xC0) == 0x80)
+        {
+            continue; // continuation byte, keep looking for the lead byte
+        }
+
+        size_t expected = (c & 0x80) == 0 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return back >= expected ? length : length - back;
+    }
+    return length;
+}
+
+struct StreamOptions
+{
+    int chunkTokens = 1;   // wake JS up at most once per this many tokens
+    int intervalUs = 0;    // ... or once this many microseconds passed since the last wakeup
+    bool tokens = false;   // also deliver the token ids as Int32Array
+};
+
+//  Streams generated pieces through preallocated ring buffers, JS gets woken up once per coalesced
+//  chunk instead of once per token and nothing is allocated per token on the inference thread
+class InferenceWorker : public PoolWorker
+{
+public:
+    InferenceWorker(const Napi::Function &callback,
+                    llama_model *model,
+                    context_handle *context,
+                    const std::string &systemPrompt,
+                    const std::string &userPrompt,
+                    int maxTokens,
+                    size_t seed,
+                    const sampling_params &sampling,
+                    const StreamOptions &stream,
+                    chat_session *chat = nullptr,
+                    const std::shared_ptr<cancel_state> &cancel = nullptr,
+                    const draft_params &draft = draft_params(),
+                    token_view promptTokens = token_view())
+        : PoolWorker(callback, "InferenceWorker"),
+          _model(model),
+          _context(context),
+          _chat(chat),
+          _cancel(cancel),
+          _draft(draft),
+          _systemPrompt(systemPrompt),
+          _userPrompt(userPrompt),
+          _promptTokens(promptTokens),
+          _maxTokens(maxTokens),
+          _seed(seed),
+          _sampling(sampling),
+          _stream(stream),
+          _text(64 * 1024),
+          _tokens(4 * 1024)
+    {
+        _drainedText.reserve(64 * 1024);
+        _drainedTokens.reserve(4 * 1024);
+    }
+
+    void Execute() override
+    {
+        if (!_model || !_context)
+        {
+            SetError("Invalid model or context handle");
+            return;
+        }
+
+        stream_callback_info streamInfo;
+        streamInfo.callback = [](const char *text, size_t length, llama_token token, bool done, void *data)
+        {
+            static_cast<InferenceWorker *>(data)->produce(text, length, token, done);
+        };
+        streamInfo.data = this;
+
+        if (_cancel && _cancel->stopped())
+        {
+            SetError(_cancel->reason());
+            return;
+        }
+
+        _lastWakeup = std::chrono::steady_clock::now();
+        const draft_params *draft = _draft.enabled() ? &_draft : nullptr;
+        _context->cancel = _cancel.get();
+        if (_draft.context != nullptr)
+        {
+            _draft.context->cancel = _cancel.get();
+        }
+
+        if (_chat != nullptr)
+        {
+            _result = runChat(_model, _context, _chat, _userPrompt, _maxTokens, _seed, _sampling, &streamInfo, draft);
+        }
+        else if (!_promptTokens.empty())
+        {
+            _result = runInferenceTokens(_model, _context, _promptTokens, _maxTokens, _seed, _sampling, &streamInfo, nullptr, draft);
+        }
+        else
+        {
+            _result = runInference(_model, _context, _systemPrompt, _userPrompt, _maxTokens, _seed, _sampling, &streamInfo, draft);
+        }
+
+        _context->cancel = nullptr;
+        if (_draft.context != nullptr)
+        {
+            _draft.context->cancel = nullptr;
+        }
+
+        if (_cancel && _cancel->triggered())
+        {
+            SetError(_cancel->reason());
+        }
+        else if (_result.empty())
+        {
+            SetError("Failed to run inference");
+        }
+    }
+
+    void OnWorkProgress(void *) override
+    {
+        Napi::HandleScope scope(Env());
+        drain(false);
+    }
+
+    //  Chat handle or prompt tokens must outlive the worker even if JS drops them meanwhile
+    void KeepAlive(const Napi::Value &value)
+    {
+        _keepAlive = Napi::Reference<Napi::Value>::New(value, 1);
+    }
+
+    void OnOK() override
+    {
+        Napi::HandleScope scope(Env());
+
+        //  Whatever was produced after the last wakeup
+        drain(true);
+
+        Callback().Call({
+            Env().Null(),                     // error arg
+            Napi::String::New(Env(), _result) // result arg
+        });
+    }
+
+    void OnError(const Napi::Error &error) override
+    {
+        Napi::HandleScope scope(Env());
+        Callback().Call({Napi::String::New(Env(), error.Message()),
+                         Env().Null()});
+    }
+
+private:
+    void produce(const char *text, size_t length, llama_token token, bool done)
+    {
+        //  An aborted run ends with the error alone, never with a done event ahead of it. Once done
+        //  went out the reply stands, the chat keeps it and the promise resolves.
+        if (done && _cancel)
+        {
+            if (_cancel->triggered())
+            {
+                return;
+            }
+            _cancel->finished = true;
+        }
+
+        //  Wait for JS to make room if it fell that much behind
+        while (length > 0)
+        {
+            size_t written = _text.write(text, length);
+            text += written;
+            length -= written;
+
+            if (length > 0)
+            {
+                wakeup();
+                std::this_thread::yield();
+            }
+        }
+
+        if (!done)
+        {
+            if (_stream.tokens)
+            {
+                while (_tokens.write(&token, 1) == 0)
+                {
+                    wakeup();
+                    std::this_thread::yield();
+                }
+            }
+            _pendingTokens++;
+        }
+        else
+        {
+            _done.store(true, std::memory_order_release);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        bool interval = _stream.intervalUs > 0 &&
+                        std::chrono::duration_cast<std::chrono::microseconds>(now - _lastWakeup).count() >= _stream.intervalUs;
+
+        if (done || _pendingTokens >= _stream.chunkTokens || interval)
+        {
+            _pendingTokens = 0;
+            _lastWakeup = now;
+            wakeup();
+        }
+    }
+
+    void wakeup()
+    {
+        if (!_wakeupPending.exchange(true, std::memory_order_acq_rel))
+        {
+            NonBlockingCall(nullptr);
+        }
+    }
+
+    void drain(bool final)
+    {
+        _wakeupPending.store(false, std::memory_order_release);
+
+        if (_doneSent)
+        {
+            return;
+        }
+
+        //  Read done before the data so nothing written before it is left behind
+        bool done = final || _done.load(std::memory_order_acquire);
+
+        size_t available = _text.size();
+        size_t length = done ? available : utf8CompleteLength(_text, available);
+
+        _drainedText.clear();
+        _drainedTokens.clear();
+        _text.read(_drainedText, length);
+        _tokens.read(_drainedTokens);
+
+        if (_drainedText.empty() && _drainedTokens.empty() && !done)
+        {
+            return;
+        }
+
+        Napi::Env env = Env();
+        Napi::Value tokens = env.Undefined();
+        if (_stream.tokens)
+        {
+            Napi::Int32Array array = Napi::Int32Array::New(env, _drainedTokens.size());
+            std::copy(_drainedTokens.begin(), _drainedTokens.end(), array.Data());
+            tokens = array;
+        }
+
+        Callback().Call({env.Null(), Napi::String::New(env, _drainedText), Napi::Boolean::New(env, done), tokens});
+        _doneSent = done;
+    }
+
+    llama_model *_model;
+    context_handle *_context;
+    chat_session *_chat;
+    std::shared_ptr<cancel_state> _cancel;
+    draft_params _draft;
+    Napi::Reference<Napi::Value> _keepAlive;
+    std::string _systemPrompt;
+    std::string _userPrompt;
+    token_view _promptTokens;
+    int _maxTokens;
+    size_t _seed;
+    sampling_params _sampling;
+    std::string _result;
+
+    StreamOptions _stream;
+    spsc_ring<char> _text;
+    spsc_ring<llama_token> _tokens;
+    std::atomic<bool> _wakeupPending{false};
+    std::atomic<bool> _done{false};
+
+    //  Inference thread only
+    int _pendingTokens = 0;
+    std::chrono::steady_clock::time_point _lastWakeup;
+
+    //  JS thread only
+    std::string _drainedText;
+    std::vector<llama_token> _drainedTokens;
+    bool _doneSent = false;
+};
+
+struct RunInferenceAsyncOptions
+{
+    llama_model *model;
+    context_handle *context;
+    std::string prompt;
+    token_view promptTokens;
+    Napi::Value promptValue;
+    std::string systemPrompt;
+    int maxTokens = 1024;
+    size_t seed = LLAMA_DEFAULT_SEED;
+    sampling_params sampling;
+    StreamOptions stream;
+    Napi::FunctionReference callback;
+    chat_session *chat = nullptr;
+    Napi::Value chatValue;
+    Napi::Value signal;
+    int timeoutMs = 0;
+    draft_params draft;
+};
+
+RunInferenceAsyncOptions ParseRunInferenceAsyncOptions(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsObject())
+    {
+        Napi::TypeError::New(env, "Expected an options object").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    Napi::Object optionsObj = info[0].As<Napi::Object>();
+    RunInferenceAsyncOptions options;
+
+    if (optionsObj.Has("model") && optionsObj.Get("model").IsExternal())
+    {
+        options.model = optionsObj.Get("model").As<Napi::External<llama_model>>().Data();
+    }
+    else
+    {
+        Napi::TypeError::New(env, "model is required and should be an external").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    if (optionsObj.Has("context") && optionsObj.Get("context").IsExternal())
+    {
+        options.context = optionsObj.Get("context").As<Napi::External<context_handle>>().Data();
+    }
+    else
+    {
+        Napi::TypeError::New(env, "context is required and should be an external").ThrowAsJavaScriptException();
+        return {};
+    }
+
+    if (!ParsePromptOption(optionsObj, options.prompt, options.promptTokens))
+    {
+        return {};
+    }
+
+    if (optionsObj.Has("systemPrompt") && optionsObj.Get("systemPrompt").IsString())
+    {
+        options.systemPrompt = optionsObj.Get("systemPrompt").As<Napi::String>().Utf8Value();
+    }
+
+    if (optionsObj.Has("maxTokens") && optionsObj.Get("maxTokens").IsNumber())
+    {
+        options.maxTokens = optionsObj.Get("maxTokens").As<Napi::Number>().Int32Value();
+    }
+
+    if (optionsObj.Has("seed") && optionsObj.Get("seed").IsNumber())
+    {
+        options.seed = optionsObj.Get("seed").As<Napi::Number>().Uint32Value();
+    }
+
+    if (optionsObj.Has("onStream") && optionsObj.Get("onStream").IsFunction())
+    {
+        options.callback = Napi::Persistent(optionsObj.Get("onStream").As<Napi::Function>());
+    }
+
+    if (optionsObj.Has("streamChunkTokens") && optionsObj.Get("streamChunkTokens").IsNumber())
+    {
+        options.stream.chunkTokens = std::max(1, optionsObj.Get("streamChunkTokens").As<Napi::Number>().Int32Value());
+    }
+
+    if (optionsObj.Has("streamIntervalUs") && optionsObj.Get("streamIntervalUs").IsNumber())
+    {
+        options.stream.intervalUs = optionsObj.Get("streamIntervalUs").As<Napi::Number>().Int32Value();
+    }
+
+    if (optionsObj.Has("streamTokens") && optionsObj.Get("streamTokens").IsBoolean())
+    {
+        options.stream.tokens = optionsObj.Get("streamTokens").As<Napi::Boolean>().Value();
+    }
+
+    if (optionsObj.Has("signal") && optionsObj.Get("signal").IsObject())
+    {
+        options.signal = optionsObj.Get("signal");
+    }
+
+    if (optionsObj.Has("timeoutMs") && optionsObj.Get("timeoutMs").IsNumber())
+    {
+        options.timeoutMs = optionsObj.Get("timeoutMs").As<Napi::Number>().Int32Value();
+    }
+
+    if (optionsObj.Has("chat") && optionsObj.Get("chat").IsExternal())
+    {
+        options.chatValue = optionsObj.Get("chat");
+        options.chat = options.chatValue.As<Napi::External<chat_session>>().Data();
+    }
+
+    if (!options.promptTokens.empty())
+    {
+        options.promptValue = optionsObj.Get("prompt");
+        if (options.chat != nullptr)
+        {
+            Napi::TypeError::New(env, "Chat prompts should be text").ThrowAsJavaScriptException();
+            return {};
+        }
+
+        if (!tokensInVocab(options.model, options.promptTokens))
+        {
+            Napi::TypeError::New(env, "Prompt token id out of range").ThrowAsJavaScriptException();
+            return {};
+        }
+    }
+
+    if (optionsObj.Has("draft") && optionsObj.Get("draft").IsObject())
+    {
+        Napi::Object draftObj = optionsObj.Get("draft").As<Napi::Object>();
+        ParseNumberOption(draftObj, "maxTokens", options.draft.maxTokens);
+        ParseNumberOption(draftObj, "pMin", options.draft.pMin);
+        ParseNumberOption(draftObj, "ngram", options.draft.ngram);
+
+        //  Rejected guesses are cut from the caches, which recurrent models can not do
+        if (llama_model_is_recurrent(options.model))
+        {
+            Napi::TypeError::New(env, "Speculative decoding does not support recurrent models").ThrowAsJavaScriptException();
+            return {};
+        }
+
+        if (draftObj.Has("context") && !draftObj.Get("context").IsUndefined() && !draftObj.Get("context").IsExternal())
+        {
+            Napi::TypeError::New(env, "draft.context should be an external").ThrowAsJavaScriptException();
+            return {};
+        }
+
+        if (draftObj.Has("context") && draftObj.Get("context").IsExternal())
+        {
+            options.draft.context = draftObj.Get("context").As<Napi::External<context_handle>>().Data();
+
+            const llama_model *draftModel = llama_get_model(options.draft.context->ctx);
+            if (options.draft.context == options.context || llama_model_is_recurrent(draftModel))
+            {
+                Napi::TypeError::New(env, "Speculative decoding needs a separate draft context of a transformer model").ThrowAsJavaScriptException();
+                return {};
+            }
+
+            if (!draftCompatible(options.model, draftModel))
+            {
+                Napi::TypeError::New(env, "Draft model vocabulary does not match the model").ThrowAsJavaScriptException();
+                return {};
+            }
+        }
+        else if (options.draft.ngram <= 0)
+        {
+            options.draft.ngram = 3;
+        }
+        else if (options.draft.ngram < LOOKUP_NGRAM_MIN)
+        {
+            Napi::TypeError::New(env, "draft.ngram should be at least 2").ThrowAsJavaScriptException();
+            return {};
+        }
+    }
+
+    options.sampling = ParseSamplingOptions(optionsObj);
+    if (!ParseGrammarOptions(optionsObj, options.model, options.sampling))
+    {
+        return {};
+    }
+
+    return options;
+}
+
+//  Keeps an AbortSignal subscribed for the lifetime of one request
+class abort_listener
+{
+public:
+    abort_listener(Napi::Object signal, const std::shared_ptr<cancel_state> &cancel)
+    {
+        Napi::Env env = signal.Env();
+        _signal = Napi::Persistent(signal);
+        _listener = Napi::Persistent(Napi::Function::New(env, [cancel](const Napi::CallbackInfo &)
+                                                         { cancel->cancelled.store(true, std::memory_order_relaxed); }, "onAbort"));
+        signal.Get("addEventListener").As<Napi::Function>().Call(signal, {Napi::String::New(env, "abort"), _listener.Value()});
+    }
+
+    void detach()
+    {
+        if (_signal.IsEmpty())
+        {
+            return;
+        }
+
+        Napi::Object signal = _signal.Value();
+        signal.Get("removeEventListener").As<Napi::Function>().Call(signal, {Napi::String::New(signal.Env(), "abort"), _listener.Value()});
+        _signal.Reset();
+        _listener.Reset();
+    }
+
+private:
+    Napi::ObjectReference _signal;
+    Napi::FunctionReference _listener;
+};
+
+//  Cancel state for the signal and timeout options, null when the request can not be cancelled
+std::shared_ptr<cancel_state> CreateCancelState(const Napi::Value &signal, int timeoutMs, std::shared_ptr<abort_listener> &listener)
+{
+    bool hasSignal = !signal.IsEmpty() && signal.IsObject();
+    if (!hasSignal && timeoutMs <= 0)
+    {
+        return nullptr;
+    }
+
+    auto cancel = std::make_shared<cancel_state>();
+    if (timeoutMs > 0)
+    {
+        cancel->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    }
+
+    if (hasSignal)
+    {
+        Napi::Object signalObj = signal.As<Napi::Object>();
+        if (signalObj.Get("aborted").ToBoolean().Value())
+        {
+            cancel->cancelled.store(true, std::memory_order_relaxed);
+        }
+        else
+        {
+            listener = std::make_shared<abort_listener>(signalObj, cancel);
+        }
+    }
+
+    return cancel;
+}
+
+//  Bridges the (error, token or result, done) convention of the native workers to a promise and an optional stream callback
+Napi::Function CreateInferenceCallback(Napi::Env env, Napi::Promise::Deferred deferred, Napi::FunctionReference streamCallback,
+                                       std::shared_ptr<abort_listener> listener = nullptr)
+{
+    return Napi::Function::New(env, [env, deferred, streamCallback = std::move(streamCallback), listener](const Napi::CallbackInfo &info)
+                               {
+        // First argument is error, second is either a token or final result
+        if (info[0].IsNull()) {
+            // No error - check if this is a token or final result
+            if (info.Length() > 2 && !info[2].IsUndefined()) {
+                // This is a token (streaming update)
+                if (!streamCallback.IsEmpty()) {
+                    streamCallback.Call({info[1], info[2], info.Length() > 3 ? info[3] : env.Undefined()});
+                }
+            } else {
+                // This is the final result
+                if (listener) listener->detach();
+                deferred.Resolve(info[1]);
+            }
+        } else {
+            // Error occurred
+            if (listener) listener->detach();
+            deferred.Reject(info[0].As<Napi::String>());
+        } }, "InferenceCallback");
+}
+
+Napi::Value RunInferenceAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    RunInferenceAsyncOptions options = ParseRunInferenceAsyncOptions(info);
+
+    if (options.model == nullptr || options.context == nullptr || (options.prompt.empty() && options.promptTokens.empty()))
+    {
+        Napi::TypeError::New(env, "Invalid options object").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    std::shared_ptr<abort_listener> listener;
+    std::shared_ptr<cancel_state> cancel = CreateCancelState(options.signal, options.timeoutMs, listener);
+
+    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+    auto callback = CreateInferenceCallback(env, deferred, std::move(options.callback), listener);
+
+    InferenceWorker *worker = new InferenceWorker(callback, options.model, options.context, options.systemPrompt, options.prompt, options.maxTokens, options.seed, options.sampling, options.stream, options.chat, cancel, options.draft, options.promptTokens);
+    if (options.chat != nullptr)
+    {
+        worker->KeepAlive(options.chatValue);
+    }
+    else if (!options.promptTokens.empty())
+    {
+        worker->KeepAlive(options.promptValue);
+    }
+    worker->Queue();
+
+    return deferred.Promise();
+}
+
+class ReleaseContextWorker : public PoolWorker
+{
+public:
+    ReleaseContextWorker(Napi::Env &env, context_handle *context)
+        : PoolWorker(env, "ReleaseContextWorker"), _context(context), _deferred(Napi::Promise::Deferred::New(env)) {}
+
+    void Execute() override
+    {
+        releaseContext(_context);
+    }
+
+    void OnOK() override
+    {
+        Napi::Env env = _deferred.Env();
+        _deferred.Resolve(env.Undefined());
+    }
+
+    void OnError(const Napi::Error &error) override
+    {
+        _deferred.Reject(error.Value());
+    }
+
+    Napi::Promise GetPromise() const
+    {
+        return _deferred.Promise();
+    }
+
+private:
+    context_handle *_context;
+    Napi::Promise::Deferred _deferred;
+};
+
+Napi::Value ReleaseContextAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsExternal())
+    {
+        Napi::TypeError::New(env, "Context handle expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    context_handle *context = info[0].As<Napi::External<context_handle>>().Data();
+
+    ReleaseContextWorker *worker = new ReleaseContextWorker(env, context);
+    worker->Queue();
+
+    return worker->GetPromise();
+}
+
+class ReleaseModelWorker : public PoolWorker
+{
+public:
+    ReleaseModelWorker(Napi::Env &env, llama_model *model)
+        : PoolWorker(env, "ReleaseModelWorker"), _model(model), _deferred(Napi::Promise::Deferred::New(env)) {}
+
+    void Execute() override
+    {
+        releaseModel(_model);
+    }
+
+    void OnOK() override
+    {
+        Napi::Env env = _deferred.Env();
+        _deferred.Resolve(env.Undefined());
+    }
+
+    void OnError(const Napi::Error &error) override
+    {
+        _deferred.Reject(error.Value());
+    }
+
+    Napi::Promise GetPromise() const
+    {
+        return _deferred.Promise();
+    }
+
+private:
+    llama_model *_model;
+    Napi::Promise::Deferred _deferred;
+};
+
+Napi::Value ReleaseModelAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsExternal())
+    {
+        Napi::TypeError::New(env, "Model handle expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    llama_model *model = info[0].As<Napi::External<llama_model>>().Data();
+
+    ReleaseModelWorker *worker = new ReleaseModelWorker(env, model);
+    worker->Queue();
+
+    return worker->GetPromise();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// SESSIONS
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//  Read only memory mapping of a whole file
+class mapped_file
+{
+public:
+    explicit mapped_file(const std::string &path)
+    {
+#ifdef _WIN32
+        _file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (_file == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+        {
+            return;
+        }
+
+        _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (_mapping == nullptr)
+        {
+            return;
+        }
+
+        _data = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+        _size = _data != nullptr ? static_cast<size_t>(size.QuadPart) : 0;
+#else
+        _fd = open(path.c_str(), O_RDONLY);
+        if (_fd < 0)
+        {
+            return;
+        }
+
+        struct stat st;
+        if (fstat(_fd, &st) != 0 || st.st_size == 0)
+        {
+            return;
+        }
+
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+        if (data == MAP_FAILED)
+        {
+            return;
+        }
+
+        posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+        _data = data;
+        _size = st.st_size;
+#endif
+    }
+
+    ~mapped_file()
+    {
+#ifdef _WIN32
+        if (_data != nullptr)
+        {
+            UnmapViewOfFile(_data);
+        }
+        if (_mapping != nullptr)
+        {
+            CloseHandle(_mapping);
+        }
+        if (_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(_file);
+        }
+#else
+        if (_data != nullptr)
+        {
+            munmap(_data, _size);
+        }
+        if (_fd >= 0)
+        {
+            close(_fd);
+        }
+#endif
+    }
+
+    const uint8_t *data() const { return static_cast<const uint8_t *>(_data); }
+    size_t size() const { return _size; }
+
+private:
+#ifdef _WIN32
+    HANDLE _file = INVALID_HANDLE_VALUE;
+    HANDLE _mapping = nullptr;
+#else
+    int _fd = -1;
+#endif
+    void *_data = nullptr;
+    size_t _size = 0;
+};
+
+//  In memory copy of sequence 0 of a context, can be restored into any context of the same model
+struct session_snapshot
+{
+    const llama_model *model = nullptr;
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> state;
+};
+
+bool saveSession(context_handle *handle, const std::string &path)
+{
+    return llama_state_seq_save_file(handle->ctx, path.c_str(), 0, handle->cached_tokens.data(), handle->cached_tokens.size()) > 0;
+}
+
+//  Restores raw sequence state into sequence 0, the tokens become the new cached prefix
+bool restoreSessionState(context_handle *handle, const uint8_t *state, size_t size, const llama_token *tokens, size_t n_tokens)
+{
+    //  Keeps a grown cache, the restored sequence would likely grow it right back
+    llama_kv_cache_seq_rm(handle->ctx, -1, -1, -1);
+    handle->cached_tokens.clear();
+
+    if (llama_state_seq_set_data(handle->ctx, state, size, 0) == 0)
+    {
+        llama_kv_cache_clear(handle->ctx);
+        handle->kv_size = llama_get_kv_cache_size(handle->ctx);
+        return false;
+    }
+
+    handle->cached_tokens.assign(tokens, tokens + n_tokens);
+    handle->kv_size = llama_get_kv_cache_size(handle->ctx);
+    return true;
+}
+
+//  Same format as llama_state_seq_save_file, but the state is read straight from the mapped file
+bool loadSession(context_handle *handle, const std::string &path, std::string &error)
+{
+    mapped_file file(path);
+    const uint8_t *data = file.data();
+    const size_t header = 3 * sizeof(uint32_t);
+
+    if (data == nullptr || file.size() < header)
+    {
+        error = "Failed to open session file";
+        return false;
+    }
+
+    uint32_t magic, version, n_tokens;
+    memcpy(&magic, data, sizeof(uint32_t));
+    memcpy(&version, data + sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&n_tokens, data + 2 * sizeof(uint32_t), sizeof(uint32_t));
+
+    const size_t state_offset = header + n_tokens * sizeof(llama_token);
+    if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION || file.size() < state_offset)
+    {
+        error = "Invalid session file";
+        return false;
+    }
+
+    std::vector<llama_token> tokens(n_tokens);
+    memcpy(tokens.data(), data + header, n_tokens * sizeof(llama_token));
+
+    if (!restoreSessionState(handle, data + state_offset, file.size() - state_offset, tokens.data(), tokens.size()))
+    {
+        error = "Failed to restore session state";
+        return false;
+    }
+
+    return true;
+}
+
+session_snapshot *snapshotSession(context_handle *handle)
+{
+    session_snapshot *snapshot = new session_snapshot();
+    snapshot->model = llama_get_model(handle->ctx);
+    snapshot->tokens = handle->cached_tokens;
+    snapshot->state.resize(llama_state_seq_get_size(handle->ctx, 0));
+    snapshot->state.resize(llama_state_seq_get_data(handle->ctx, snapshot->state.data(), snapshot->state.size(), 0));
+    return snapshot;
+}
+
+bool restoreSnapshot(context_handle *handle, const session_snapshot *snapshot, std::string &error)
+{
+    if (snapshot->model != llama_get_model(handle->ctx))
+    {
+        error = "Snapshot belongs to a different model";
+        return false;
+    }
+
+    if (!restoreSessionState(handle, snapshot->state.data(), snapshot->state.size(), snapshot->tokens.data(), snapshot->tokens.size()))
+    {
+        error = "Failed to restore session state";
+        return false;
+    }
+
+    return true;
+}
+
+enum class SessionOperation
+{
+    Save,
+    Load,
+    Snapshot,
+    Restore
+};
+
+class SessionWorker : public PoolWorker
+{
+public:
+    SessionWorker(Napi::Env &env, SessionOperation operation, context_handle *context, const std::string &path, session_snapshot *snapshot)
+        : PoolWorker(env, "SessionWorker"), _operation(operation), _context(context), _path(path), _snapshot(snapshot),
+          _deferred(Napi::Promise::Deferred::New(env)) {}
+
+    //  Keeps the snapshot alive while it is being restored
+    void KeepAlive(const Napi::Value &value)
+    {
+        _keepAlive = Napi::Reference<Napi::Value>::New(value, 1);
+    }
+
+    void Execute() override
+    {
+        std::string error;
+
+        switch (_operation)
+        {
+        case SessionOperation::Save:
+            if (!saveSession(_context, _path))
+            {
+                SetError("Failed to save session");
+            }
+            break;
+        case SessionOperation::Load:
+            if (!loadSession(_context, _path, error))
+            {
+                SetError(error);
+            }
+            break;
+        case SessionOperation::Snapshot:
+            _snapshot = snapshotSession(_context);
+            break;
+        case SessionOperation::Restore:
+            if (!restoreSnapshot(_context, _snapshot, error))
+            {
+                SetError(error);
+            }
+            break;
+        }
+    }
+
+    void OnOK() override
+    {
+        Napi::Env env = _deferred.Env();
+
+        if (_operation == SessionOperation::Snapshot)
+        {
+            //  Snapshots are plain memory, let the GC free them
+            _deferred.Resolve(Napi::External<session_snapshot>::New(env, _snapshot, [](Napi::Env, session_snapshot *snapshot)
+                                                                    { delete snapshot; }));
+            return;
+        }
+
+        //  Number of tokens now (or still) in the context
+        _deferred.Resolve(Napi::Number::New(env, _context->cached_tokens.size()));
+    }
+
+    void OnError(const Napi::Error &error) override
+    {
+        _deferred.Reject(error.Value());
+    }
+
+    Napi::Promise GetPromise() const
+    {
+        return _deferred.Promise();
+    }
+
+private:
+    SessionOperation _operation;
+    context_handle *_context;
+    std::string _path;
+    session_snapshot *_snapshot;
+    Napi::Reference<Napi::Value> _keepAlive;
+    Napi::Promise::Deferred _deferred;
+};
+
+Napi::Value QueueSessionWorker(const Napi::CallbackInfo &info, SessionOperation operation)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsExternal())
+    {
+        Napi::TypeError::New(env, "Context handle expected").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    context_handle *context = info[0].As<Napi::External<context_handle>>().Data();
+    std::string path;
+    session_snapshot *snapshot = nullptr;
+
+    if (operation == SessionOperation::Save || operation == SessionOperation::Load)
+    {
+        if (info.Length() < 2 || !info[1].IsString())
+        {
+            Napi::TypeError::New(env, "Session path expected").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        path = info[1].As<Napi::String>().Utf8Value();
+    }
+
+    if (operation == SessionOperation::Restore)
+    {
+        if (info.Length() < 2 || !info[1].IsExternal())
+        {
+            Napi::TypeError::New(env, "Snapshot handle expected").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        snapshot = info[1].As<Napi::External<session_snapshot>>().Data();
+    }
+
+    SessionWorker *worker = new SessionWorker(env, operation, context, path, snapshot);
+    if (snapshot != nullptr)
+    {
+        worker->KeepAlive(info[1]);
+    }
+    worker->Queue();
+
+    return worker->GetPromise();
+}
+
+Napi::Value SaveSessionAsync(const Napi::CallbackInfo &info)
+{
+    return QueueSessionWorker(info, SessionOperation::Save);
+}
+
+Napi::Value LoadSessionAsync(const Napi::CallbackInfo &info)
+{
+    return QueueSessionWorker(info, SessionOperation::Load);
+}
+
+Napi::Value CreateSnapshotAsync(const Napi::CallbackInfo &info)
+{
+    return QueueSessionWorker(info, SessionOperation::Snapshot);
+}
+
+Napi::Value RestoreSnapshotAsync(const Napi::CallbackInfo &info)
+{
+    return QueueSessionWorker(info, SessionOperation::Restore);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// TOKENIZATION
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//  One TokenizeAsync or DetokenizeAsync call. Inputs are split into slices queued as separate
+//  workers so they run in parallel on the worker pool, the last one to finish settles the
+//  promise. Outside of Execute everything runs on the JS thread, so pending needs no lock.
+struct token_job
+{
+    const llama_model *model;
+    bool detokenize;
+    bool special;   // addSpecial when tokenizing, removeSpecial when detokenizing
+    bool parse;     // parseSpecial when tokenizing, unparseSpecial when detokenizing
+
+    std::vector<std::string> texts;
+    std::vector<std::vector<llama_token>> tokens;
+
+    size_t pending = 0;
+    std::string error;
+    Napi::Promise::Deferred deferred;
+
+    token_job(Napi::Env env) : deferred(Napi::Promise::Deferred::New(env)) {}
+};
+
+bool detokenizeTokens(const llama_model *model, const std::vector<llama_token> &tokens, bool remove_special,
+                      bool unparse_special, std::string &text)
+{
+    text.resize(tokens.size() * 4 + 16);
+    int n = llama_detokenize(model, tokens.data(), tokens.size(), &text[0], text.size(), remove_special, unparse_special);
+    if (n < 0)
+    {
+        text.resize(-n);
+        n = llama_detokenize(model, tokens.data(), tokens.size(), &text[0], text.size(), remove_special, unparse_special);
+    }
+
+    text.resize(std::max(n, 0));
+    return n >= 0;
+}
+
+class TokenWorker : public PoolWorker
+{
+public:
+    TokenWorker(Napi::Env &env, std::shared_ptr<token_job> job, size_t first, size_t last)
+        : PoolWorker(env, "TokenWorker"), _job(job), _first(first), _last(last) {}
+
+    void Execute() override
+    {
+        token_job &job = *_job;
+        for (size_t i = _first; i < _last; i++)
+        {
+            const bool ok = job.detokenize
+                                ? detokenizeTokens(job.model, job.tokens[i], job.special, job.parse, job.texts[i])
+                                : tokenizeText(job.model, job.texts[i], job.special, job.parse, job.tokens[i]);
+            if (!ok)
+            {
+                SetError(std::string(job.detokenize ? "Failed to detokenize input " : "Failed to tokenize input ") +
+                         std::to_string(i));
+                return;
+            }
+        }
+    }
+
+    void OnOK() override
+    {
+        Finish();
+    }
+
+    void OnError(const Napi::Error &error) override
+    {
+        if (_job->error.empty())
+        {
+            _job->error = error.Message();
+        }
+        Finish();
+    }
+
+private:
+    void Finish()
+    {
+        token_job &job = *_job;
+        if (--job.pending > 0)
+        {
+            return;
+        }
+
+        Napi::Env env = job.deferred.Env();
+        if (!job.error.empty())
+        {
+            job.deferred.Reject(Napi::Error::New(env, job.error).Value());
+            return;
+        }
+
+        const size_t count = job.detokenize ? job.texts.size() : job.tokens.size();
+        Napi::Array result = Napi::Array::New(env, count);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (job.detokenize)
+            {
+                result.Set(i, Napi::String::New(env, job.texts[i]));
+                continue;
+            }
+
+            Napi::Int32Array array = Napi::Int32Array::New(env, job.tokens[i].size());
+            std::copy(job.tokens[i].begin(), job.tokens[i].end(), array.Data());
+            result.Set(i, array);
+        }
+        job.deferred.Resolve(result);
+    }
+
+    std::shared_ptr<token_job> _job;
+    size_t _first;
+    size_t _last;
+};
+
+//  Splits the job across the worker pool, one slice per thread it may run
+Napi::Value QueueTokenJob(Napi::Env env, std::shared_ptr<token_job> job, size_t count)
+{
+    if (count == 0)
+    {
+        job->deferred.Resolve(Napi::Array::New(env, 0));
+        return job->deferred.Promise();
+    }
+
+    const size_t slices = std::min(count, worker_pool::instance().maxThreads());
+
+    job->pending = slices;
+    for (size_t s = 0; s < slices; s++)
     {
-        token = llama_token_eot(model);
+        TokenWorker *worker = new TokenWorker(env, job, count * s / slices, count * (s + 1) / slices);
+        worker->Queue();
     }
-    else if (token_name == "SEP")
+
+    return job->deferred.Promise();
+}
+
+Napi::Value TokenizeAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsExternal() || !info[1].IsArray())
     {
-        token = llama_token_sep(model);
+        Napi::TypeError::New(env, "Model handle and array of strings expected").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
-    else if (token_name == "CLS")
+
+    auto job = std::make_shared<token_job>(env);
+    job->model = info[0].As<Napi::External<llama_model>>().Data();
+    job->detokenize = false;
+    job->special = true;
+    job->parse = true;
+
+    if (info.Length() > 2 && info[2].IsObject())
     {
-        token = llama_token_cls(model);
+        Napi::Object optionsObj = info[2].As<Napi::Object>();
+        if (optionsObj.Has("addSpecial") && optionsObj.Get("addSpecial").IsBoolean())
+        {
+            job->special = optionsObj.Get("addSpecial").As<Napi::Boolean>().Value();
+        }
+        if (optionsObj.Has("parseSpecial") && optionsObj.Get("parseSpecial").IsBoolean())
+        {
+            job->parse = optionsObj.Get("parseSpecial").As<Napi::Boolean>().Value();
+        }
     }
-    else if (token_name == "NL")
+
+    Napi::Array inputsArray = info[1].As<Napi::Array>();
+    job->texts.reserve(inputsArray.Length());
+    for (uint32_t i = 0; i < inputsArray.Length(); i++)
     {
-        token = llama_token_nl(model);
+        if (!inputsArray.Get(i).IsString())
+        {
+            Napi::TypeError::New(env, "Inputs should be strings").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        job->texts.push_back(inputsArray.Get(i).As<Napi::String>().Utf8Value());
     }
-    else
+    job->tokens.resize(job->texts.size());
+
+    return QueueTokenJob(env, job, job->texts.size());
+}
+
+Napi::Value DetokenizeAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsExternal() || !info[1].IsArray())
     {
-        Napi::TypeError::New(env, "Unknown token type").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Model handle and array of token arrays expected").ThrowAsJavaScriptException();
         return env.Undefined();
     }
 
-    const char *tokenValue = token > 0 ? llama_token_get_text(model, token) : nullptr;
-    return tokenValue == nullptr ? env.Undefined() : Napi::String::New(env, tokenValue);
+    auto job = std::make_shared<token_job>(env);
+    job->model = info[0].As<Napi::External<llama_model>>().Data();
+    job->detokenize = true;
+    job->special = false;
+    job->parse = true;
+
+    if (info.Length() > 2 && info[2].IsObject())
+    {
+        Napi::Object optionsObj = info[2].As<Napi::Object>();
+        if (optionsObj.Has("removeSpecial") && optionsObj.Get("removeSpecial").IsBoolean())
+        {
+            job->special = optionsObj.Get("removeSpecial").As<Napi::Boolean>().Value();
+        }
+        if (optionsObj.Has("unparseSpecial") && optionsObj.Get("unparseSpecial").IsBoolean())
+        {
+            job->parse = optionsObj.Get("unparseSpecial").As<Napi::Boolean>().Value();
+        }
+    }
+
+    //  Ids are checked here, the vocab asserts on anything out of range
+    const int n_vocab = llama_n_vocab(job->model);
+    Napi::Array inputsArray = info[1].As<Napi::Array>();
+    job->tokens.resize(inputsArray.Length());
+    for (uint32_t i = 0; i < inputsArray.Length(); i++)
+    {
+        Napi::Value input = inputsArray.Get(i);
+        std::vector<llama_token> &tokens = job->tokens[i];
+
+        if (input.IsTypedArray() && input.As<Napi::TypedArray>().TypedArrayType() == napi_int32_array)
+        {
+            Napi::Int32Array array = input.As<Napi::Int32Array>();
+            tokens.assign(array.Data(), array.Data() + array.ElementLength());
+        }
+        else if (input.IsArray())
+        {
+            Napi::Array array = input.As<Napi::Array>();
+            tokens.reserve(array.Length());
+            for (uint32_t t = 0; t < array.Length(); t++)
+            {
+                tokens.push_back(array.Get(t).IsNumber() ? array.Get(t).As<Napi::Number>().Int32Value() : -1);
+            }
+        }
+        else
+        {
+            Napi::TypeError::New(env, "Inputs should be Int32Array or arrays of token ids").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+
+        for (llama_token token : tokens)
+        {
+            if (token < 0 || token >= n_vocab)
+            {
+                Napi::TypeError::New(env, "Token id out of range in input " + std::to_string(i)).ThrowAsJavaScriptException();
+                return env.Undefined();
+            }
+        }
+    }
+    job->texts.resize(job->tokens.size());
+
+    return QueueTokenJob(env, job, job->tokens.size());
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// ASYNC
+// EMBEDDINGS
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-class LoadModelWorker : public Napi::AsyncWorker
+//  Embeds all inputs into out (n_inputs x dimensions, row major), packing as many sequences into
+//  each batch as the context allows. Returns false and fills error on failure.
+bool embedInputs(context_handle *handle, const std::vector<std::string> &inputs, bool normalize,
+                 std::vector<float> &out, std::string &error)
+{
+    llama_context *ctx = handle->ctx;
+    const llama_model *model = llama_get_model(ctx);
+    const enum llama_pooling_type pooling = llama_pooling_type(ctx);
+    const int n_embd = llama_n_embd(model);
+    const int n_seq_max = llama_n_seq_max(ctx);
+
+    //  Pooled sequences have to be decoded as a whole, non causal models even within a single ubatch
+    const int n_cap = std::min(llama_n_batch(ctx), llama_n_ubatch(ctx));
+    const bool encoder_only = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+
+    const int dimensions = pooling == LLAMA_POOLING_TYPE_RANK ? 1 : n_embd;
+
+    std::vector<std::vector<llama_token>> tokens(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (!inputs[i].empty() && !tokenizePrompt(model, inputs[i], tokens[i]))
+        {
+            error = "Failed to tokenize input " + std::to_string(i);
+            return false;
+        }
+
+        if (static_cast<int>(tokens[i].size()) > n_cap)
+        {
+            error = "Input " + std::to_string(i) + " is longer than the context batch size";
+            return false;
+        }
+    }
+
+    out.assign(inputs.size() * dimensions, 0.0f);
+
+    //  The KV cache gets overwritten, forget what the generation path had in it. Between batches only the cells
+    //  are dropped, clearing would shrink a grown cache and every larger batch would grow it again
+    llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+    handle->cached_tokens.clear();
+    llama_set_embeddings(ctx, true);
+
+    llama_batch batch = llama_batch_init(n_cap, 0, 1);
+    bool ok = true;
+
+    for (size_t first = 0; first < inputs.size() && ok;)
+    {
+        //  Pack sequences while they fit
+        batch.n_tokens = 0;
+        size_t last = first;
+        while (last < inputs.size() && static_cast<int>(last - first) < n_seq_max &&
+               batch.n_tokens + static_cast<int>(tokens[last].size()) <= n_cap)
+        {
+            for (size_t t = 0; t < tokens[last].size(); t++)
+            {
+                batch.token[batch.n_tokens] = tokens[last][t];
+                batch.pos[batch.n_tokens] = t;
+                batch.n_seq_id[batch.n_tokens] = 1;
+                batch.seq_id[batch.n_tokens][0] = last - first;
+                batch.logits[batch.n_tokens] = true;
+                batch.n_tokens++;
+            }
+            last++;
+        }
+
+        if (batch.n_tokens > 0 && decodeContext(handle, batch, encoder_only) != 0)
+        {
+            error = "Failed to decode";
+            ok = false;
+            break;
+        }
+
+        int i_token = 0;
+        for (size_t i = first; i < last; i++)
+        {
+            float *row = out.data() + i * dimensions;
+            const int n_tokens = tokens[i].size();
+
+            if (n_tokens == 0)
+            {
+                continue;
+            }
+
+            if (pooling != LLAMA_POOLING_TYPE_NONE)
+            {
+                const float *pooled = llama_get_embeddings_seq(ctx, i - first);
+                if (pooled == nullptr)
+                {
+                    error = "Failed to get pooled embeddings";
+                    ok = false;
+                    break;
+                }
+                std::copy(pooled, pooled + dimensions, row);
+            }
+            else
+            {
+                //  Model without pooling, average the token embeddings
+                for (int t = 0; t < n_tokens; t++)
+                {
+                    const float *embd = llama_get_embeddings_ith(ctx, i_token + t);
+                    if (embd == nullptr)
+                    {
+                        error = "Failed to get token embeddings";
+                        ok = false;
+                        break;
+                    }
+
+                    for (int d = 0; d < n_embd; d++)
+                    {
+                        row[d] += embd[d] / n_tokens;
+                    }
+                }
+
+                if (!ok)
+                {
+                    break;
+                }
+            }
+            i_token += n_tokens;
+
+            if (normalize && pooling != LLAMA_POOLING_TYPE_RANK)
+            {
+                double sum = 0.0;
+                for (int d = 0; d < dimensions; d++)
+                {
+                    sum += row[d] * row[d];
+                }
+
+                const float norm = sum > 0.0 ? 1.0 / std::sqrt(sum) : 0.0f;
+                for (int d = 0; d < dimensions; d++)
+                {
+                    row[d] *= norm;
+                }
+            }
+        }
+
+        llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+        first = last;
+    }
+
+    llama_kv_cache_clear(ctx);
+    handle->kv_size = llama_get_kv_cache_size(ctx);
+
+    llama_batch_free(batch);
+    llama_set_embeddings(ctx, false);
+    return ok;
+}
+
+class EmbedWorker : public PoolWorker
 {
 public:
-    LoadModelWorker(Napi::Env &env, const std::string &modelPath)
-        : Napi::AsyncWorker(env), _modelPath(modelPath), _deferred(Napi::Promise::Deferred::New(env)) {}
+    EmbedWorker(Napi::Env &env, context_handle *context, std::vector<std::string> &&inputs, bool normalize)
+        : PoolWorker(env, "EmbedWorker"), _context(context), _inputs(std::move(inputs)), _normalize(normalize),
+          _deferred(Napi::Promise::Deferred::New(env)) {}
 
     void Execute() override
     {
-        _model = loadModel(_modelPath);
-
-        if (_model == nullptr)
+        std::string error;
+        _embeddings = new std::vector<float>();
+        if (!embedInputs(_context, _inputs, _normalize, *_embeddings, error))
         {
-            SetError("Failed to load model");
+            SetError(error);
         }
     }
 
@@ -406,9 +4553,24 @@ public:
     {
         Napi::Env env = _deferred.Env();
 
-        // Wrap the model pointer in an external
-        Napi::External<llama_model> modelExternal = Napi::External<llama_model>::New(env, _model);
-        _deferred.Resolve(modelExternal);
+        //  Hand the buffer over to JS as is, freed together with the array
+        std::vector<float> *embeddings = _embeddings;
+        _embeddings = nullptr;
+
+        if (embeddings->empty())
+        {
+            delete embeddings;
+            _deferred.Resolve(Napi::Float32Array::New(env, 0));
+            return;
+        }
+
+        Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(
+            env, embeddings->data(), embeddings->size() * sizeof(float),
+            [](Napi::Env, void *, std::vector<float> *data)
+            { delete data; },
+            embeddings);
+
+        _deferred.Resolve(Napi::Float32Array::New(env, embeddings->size(), buffer, 0));
     }
 
     void OnError(const Napi::Error &error) override
@@ -421,81 +4583,498 @@ public:
         return _deferred.Promise();
     }
 
+    ~EmbedWorker()
+    {
+        delete _embeddings;
+    }
+
 private:
-    std::string _modelPath;
-    llama_model *_model = nullptr;
+    context_handle *_context;
+    std::vector<std::string> _inputs;
+    bool _normalize;
+    std::vector<float> *_embeddings = nullptr;
     Napi::Promise::Deferred _deferred;
 };
 
-Napi::Value LoadModelAsync(const Napi::CallbackInfo &info)
+Napi::Value EmbedAsync(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
-    if (info.Length() < 1 || !info[0].IsString())
+    if (info.Length() < 2 || !info[0].IsExternal() || !info[1].IsArray())
     {
-        Napi::TypeError::New(env, "Model path expected").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Context handle and array of strings expected").ThrowAsJavaScriptException();
         return env.Undefined();
     }
 
-    std::string modelPath = info[0].As<Napi::String>().Utf8Value();
+    context_handle *context = info[0].As<Napi::External<context_handle>>().Data();
+    Napi::Array inputsArray = info[1].As<Napi::Array>();
+
+    std::vector<std::string> inputs;
+    inputs.reserve(inputsArray.Length());
+    for (uint32_t i = 0; i < inputsArray.Length(); i++)
+    {
+        if (!inputsArray.Get(i).IsString())
+        {
+            Napi::TypeError::New(env, "Inputs should be strings").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        inputs.push_back(inputsArray.Get(i).As<Napi::String>().Utf8Value());
+    }
+
+    bool normalize = true;
+    if (info.Length() > 2 && info[2].IsObject())
+    {
+        Napi::Object optionsObj = info[2].As<Napi::Object>();
+        if (optionsObj.Has("normalize") && optionsObj.Get("normalize").IsBoolean())
+        {
+            normalize = optionsObj.Get("normalize").As<Napi::Boolean>().Value();
+        }
+    }
 
-    LoadModelWorker *worker = new LoadModelWorker(env, modelPath);
+    EmbedWorker *worker = new EmbedWorker(env, context, std::move(inputs), normalize);
     worker->Queue();
 
     return worker->GetPromise();
 }
 
-class CreateContextWorker : public Napi::AsyncWorker
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// BATCH ENGINE
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//  Event sent from the engine thread to JS, either a streamed piece, the final result or an error
+struct BatchEvent
+{
+    std::string text;
+    bool done;
+    bool failed;
+};
+
+struct batch_request
+{
+    std::string systemPrompt;
+    std::string userPrompt;
+    std::vector<llama_token> promptTokens; // copied, the request may wait in the queue
+    int maxTokens;
+    size_t seed;
+    sampling_params sampling;
+    std::shared_ptr<cancel_state> cancel;
+    Napi::ThreadSafeFunction tsfn;
+};
+
+//  One sequence of the shared context, owned by the engine thread
+struct batch_slot
+{
+    llama_seq_id seq_id = 0;
+    batch_request *request = nullptr;
+    llama_sampler *smpl = nullptr;
+    std::vector<llama_token> prompt_tokens;
+    size_t n_prompt_done = 0; // prompt tokens already decoded
+    llama_pos n_past = 0;
+    llama_token last_token = 0; // sampled but not yet decoded
+    int n_generated = 0;
+    int i_batch = -1; // index of this slot's logits in the current batch
+    llama_pos n_past_step = 0;  // n_past before the current batch, restored when its decode fails
+    size_t n_prompt_step = 0;   // n_prompt_done before the current batch
+    std::string result;
+};
+
+void sendBatchEvent(batch_request *request, const std::string &text, bool done, bool failed)
+{
+    auto event = new BatchEvent{text, done, failed};
+    request->tsfn.NonBlockingCall(event, [](Napi::Env env, Napi::Function callback, BatchEvent *event)
+                                  {
+        if (event->failed) {
+            callback.Call({Napi::String::New(env, event->text), env.Null()});
+        } else if (event->done) {
+            callback.Call({env.Null(), Napi::String::New(env, ""), Napi::Boolean::New(env, true)});
+            callback.Call({env.Null(), Napi::String::New(env, event->text)});
+        } else {
+            callback.Call({env.Null(), Napi::String::New(env, event->text), Napi::Boolean::New(env, false)});
+        }
+        delete event; });
+}
+
+//  Continuous batching - every step packs the next token of all generating sequences together with
+//  prompt chunks of newly admitted ones into a single llama_batch over one shared context
+class batch_engine
 {
 public:
-    CreateContextWorker(Napi::Env &env, llama_model *model, int n_threads, int n_ctx, bool flash_attn)
-        : Napi::AsyncWorker(env), _model(model), _n_threads(n_threads), _n_ctx(n_ctx), _flash_attn(flash_attn),
-          _deferred(Napi::Promise::Deferred::New(env)) {}
+    batch_engine(llama_model *model, context_handle *context)
+        : _model(model), _context(context), _ctx(context->ctx), _n_batch(llama_n_batch(_ctx)), _slots(llama_n_seq_max(_ctx)),
+          _kv_size_init(llama_get_kv_cache_size(_ctx))
+    {
+        for (size_t i = 0; i < _slots.size(); i++)
+        {
+            _slots[i].seq_id = i;
+        }
+        _batch = llama_batch_init(_n_batch, 0, 1);
+        _thread = std::thread(&batch_engine::run, this);
+    }
 
-    void Execute() override
+    ~batch_engine()
+    {
+        stop();
+        llama_batch_free(_batch);
+        releaseContext(_context);
+    }
+
+    llama_model *model() const
+    {
+        return _model;
+    }
+
+    void enqueue(batch_request *request)
     {
-        _context = createContext(_model, _n_threads, _n_ctx, _flash_attn);
-        if (_context == nullptr)
         {
-            SetError("Failed to create context");
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_running)
+            {
+                _pending.push_back(request);
+                request = nullptr;
+            }
+        }
+
+        //  The engine thread is gone and would never pick the request up
+        if (request != nullptr)
+        {
+            sendBatchEvent(request, "Batch engine released", true, true);
+            request->tsfn.Release();
+            delete request;
+            return;
         }
+        _cv.notify_one();
     }
 
-    void OnOK() override
+    void stop()
     {
-        Napi::Env env = _deferred.Env();
-        Napi::External<llama_context> contextExternal = Napi::External<llama_context>::New(env, _context);
-        _deferred.Resolve(contextExternal);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _running = false;
+        }
+        _cv.notify_one();
+
+        if (_thread.joinable())
+        {
+            _thread.join();
+        }
+    }
+
+private:
+    bool hasActiveSlots() const
+    {
+        for (const batch_slot &slot : _slots)
+        {
+            if (slot.request != nullptr)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void admit(batch_slot &slot, batch_request *request)
+    {
+        if (request->cancel && request->cancel->stopped())
+        {
+            sendBatchEvent(request, request->cancel->reason(), true, true);
+            request->tsfn.Release();
+            delete request;
+            return;
+        }
+
+        if (!request->promptTokens.empty())
+        {
+            slot.prompt_tokens = std::move(request->promptTokens);
+        }
+        else if (!tokenizePrompt(_model, formatPrompt(_model, request->systemPrompt, request->userPrompt), slot.prompt_tokens))
+        {
+            sendBatchEvent(request, "Failed to tokenize the prompt", true, true);
+            request->tsfn.Release();
+            delete request;
+            return;
+        }
+
+        if (slot.prompt_tokens.size() >= llama_n_ctx(_ctx))
+        {
+            slot.prompt_tokens.clear();
+            sendBatchEvent(request, "The prompt does not fit the context", true, true);
+            request->tsfn.Release();
+            delete request;
+            return;
+        }
+
+        llama_sampler *smpl = createSampler(_model, request->seed, request->sampling);
+        if (smpl == nullptr)
+        {
+            sendBatchEvent(request, "Failed to parse the grammar", true, true);
+            request->tsfn.Release();
+            delete request;
+            return;
+        }
+
+        slot.request = request;
+        slot.smpl = smpl;
+        slot.n_prompt_done = 0;
+        slot.n_past = 0;
+        slot.n_generated = 0;
+        slot.i_batch = -1;
+        slot.result.clear();
+    }
+
+    void finish(batch_slot &slot, const char *error)
+    {
+        error == nullptr ? sendBatchEvent(slot.request, slot.result, true, false) : sendBatchEvent(slot.request, error, true, true);
+        slot.request->tsfn.Release();
+        delete slot.request;
+
+        llama_sampler_free(slot.smpl);
+        llama_kv_cache_seq_rm(_ctx, slot.seq_id, -1, -1);
+
+        slot.request = nullptr;
+        slot.smpl = nullptr;
+        slot.prompt_tokens.clear();
+        slot.result.clear();
+    }
+
+    void addToBatch(llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits)
+    {
+        _batch.token[_batch.n_tokens] = token;
+        _batch.pos[_batch.n_tokens] = pos;
+        _batch.n_seq_id[_batch.n_tokens] = 1;
+        _batch.seq_id[_batch.n_tokens][0] = seq_id;
+        _batch.logits[_batch.n_tokens] = logits;
+        _batch.n_tokens++;
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            std::vector<batch_request *> admitted;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+
+                //  Going idle - a cache grown by a burst of long requests shrinks back to its initial size
+                if (_pending.empty() && !hasActiveSlots() && _context->kv_size > _kv_size_init)
+                {
+                    llama_kv_cache_clear(_ctx);
+                    _context->kv_size = llama_get_kv_cache_size(_ctx);
+                }
+
+                _cv.wait(lock, [this]
+                         { return !_running || !_pending.empty() || hasActiveSlots(); });
+
+                if (!_running)
+                {
+                    break;
+                }
+
+                for (const batch_slot &slot : _slots)
+                {
+                    if (slot.request == nullptr && !_pending.empty())
+                    {
+                        admitted.push_back(_pending.front());
+                        _pending.pop_front();
+                    }
+                }
+            }
+
+            //  Tokenize outside of the lock so JS can keep enqueueing
+            size_t next = 0;
+            for (batch_slot &slot : _slots)
+            {
+                if (slot.request == nullptr && next < admitted.size())
+                {
+                    admit(slot, admitted[next++]);
+                }
+            }
+
+            step();
+        }
+
+        //  Engine released - fail everything still in flight
+        for (batch_slot &slot : _slots)
+        {
+            if (slot.request != nullptr)
+            {
+                finish(slot, "Batch engine released");
+            }
+        }
+
+        std::deque<batch_request *> pending;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            pending.swap(_pending);
+        }
+
+        for (batch_request *request : pending)
+        {
+            sendBatchEvent(request, "Batch engine released", true, true);
+            request->tsfn.Release();
+            delete request;
+        }
+    }
+
+    void fillBatch()
+    {
+        _batch.n_tokens = 0;
+
+        //  Decodes first, one token per generating sequence
+        for (batch_slot &slot : _slots)
+        {
+            slot.i_batch = -1;
+            slot.n_past_step = slot.n_past;
+            slot.n_prompt_step = slot.n_prompt_done;
+            if (slot.request != nullptr && slot.n_prompt_done == slot.prompt_tokens.size())
+            {
+                slot.i_batch = _batch.n_tokens;
+                addToBatch(slot.last_token, slot.n_past++, slot.seq_id, true);
+            }
+        }
+
+        //  Fill the rest of the batch with prompt chunks
+        for (batch_slot &slot : _slots)
+        {
+            while (slot.request != nullptr && slot.n_prompt_done < slot.prompt_tokens.size() && _batch.n_tokens < _n_batch)
+            {
+                const bool last = slot.n_prompt_done + 1 == slot.prompt_tokens.size();
+                if (last)
+                {
+                    slot.i_batch = _batch.n_tokens;
+                }
+                addToBatch(slot.prompt_tokens[slot.n_prompt_done++], slot.n_past++, slot.seq_id, last);
+            }
+        }
     }
 
-    void OnError(const Napi::Error &error) override
+    //  Undoes a failed batch, ubatches decoded before the failure may have left cells behind
+    void rollbackBatch()
     {
-        _deferred.Reject(error.Value());
+        for (batch_slot &slot : _slots)
+        {
+            if (slot.request != nullptr)
+            {
+                slot.n_past = slot.n_past_step;
+                slot.n_prompt_done = slot.n_prompt_step;
+                llama_kv_cache_seq_rm(_ctx, slot.seq_id, slot.n_past, -1);
+            }
+        }
     }
 
-    Napi::Promise GetPromise() const
+    void step()
     {
-        return _deferred.Promise();
+        //  Cancelled requests leave before the next decode, the shared graph itself is never aborted
+        for (batch_slot &slot : _slots)
+        {
+            if (slot.request != nullptr && slot.request->cancel && slot.request->cancel->stopped())
+            {
+                finish(slot, slot.request->cancel->reason());
+            }
+        }
+
+        while (true)
+        {
+            fillBatch();
+            if (_batch.n_tokens == 0)
+            {
+                return;
+            }
+
+            const int status = decodeContext(_context, _batch);
+            if (status == 0)
+            {
+                break;
+            }
+
+            rollbackBatch();
+            if (status != 1)
+            {
+                fprintf(stderr, "Error: Failed to decode batch\n");
+                for (batch_slot &slot : _slots)
+                {
+                    if (slot.request != nullptr)
+                    {
+                        finish(slot, "Failed to decode");
+                    }
+                }
+                return;
+            }
+
+            //  No room left in the shared KV cache - evict the longest sequence and retry without it
+            batch_slot *longest = nullptr;
+            for (batch_slot &slot : _slots)
+            {
+                if (slot.request != nullptr && (longest == nullptr || slot.n_past > longest->n_past))
+                {
+                    longest = &slot;
+                }
+            }
+            finish(*longest, "Context is full");
+        }
+
+        for (batch_slot &slot : _slots)
+        {
+            if (slot.request == nullptr || slot.i_batch < 0)
+            {
+                continue;
+            }
+
+            llama_token new_token_id = llama_sampler_sample(slot.smpl, _ctx, slot.i_batch);
+            if (llama_token_is_eog(_model, new_token_id))
+            {
+                finish(slot, nullptr);
+                continue;
+            }
+
+            char buf[128];
+            int n = llama_token_to_piece(_model, new_token_id, buf, sizeof(buf), 0, true);
+            if (n < 0)
+            {
+                finish(slot, "Failed to convert token to piece");
+                continue;
+            }
+
+            slot.result.append(buf, n);
+            sendBatchEvent(slot.request, std::string(buf, n), false, false);
+
+            slot.last_token = new_token_id;
+            if (++slot.n_generated >= slot.request->maxTokens)
+            {
+                finish(slot, nullptr);
+            }
+        }
     }
 
-private:
     llama_model *_model;
-    llama_context *_context;
-    int _n_threads;
-    int _n_ctx;
-    bool _flash_attn;
-    Napi::Promise::Deferred _deferred;
+    context_handle *_context;
+    llama_context *_ctx;
+    int32_t _n_batch;
+    llama_batch _batch;
+    std::vector<batch_slot> _slots;
+    size_t _kv_size_init;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<batch_request *> _pending;
+    bool _running = true;
+    std::thread _thread;
 };
 
-struct CreateContextOptions
+struct CreateBatchEngineOptions
 {
     llama_model *model;
     int threads = 1;
     int nCtx = 0;
     bool flashAttention = true;
+    ggml_type typeK = GGML_TYPE_F16;
+    ggml_type typeV = GGML_TYPE_F16;
+    int threadsBatch = 0;
+    int maxSequences = 4;
+    int batchSize = 512;
+    int nCtxInit = -1;
 };
 
-CreateContextOptions ParseCreateContextOptions(const Napi::CallbackInfo &info)
+CreateBatchEngineOptions ParseCreateBatchEngineOptions(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
@@ -506,7 +5085,7 @@ CreateContextOptions ParseCreateContextOptions(const Napi::CallbackInfo &info)
     }
 
     Napi::Object optionsObj = info[0].As<Napi::Object>();
-    CreateContextOptions options;
+    CreateBatchEngineOptions options;
 
     if (optionsObj.Has("model") && optionsObj.Get("model").IsExternal())
     {
@@ -518,10 +5097,8 @@ CreateContextOptions ParseCreateContextOptions(const Napi::CallbackInfo &info)
         return {};
     }
 
-    if (optionsObj.Has("threads") && optionsObj.Get("threads").IsNumber())
-    {
-        options.threads = optionsObj.Get("threads").As<Napi::Number>().Int32Value();
-    }
+    ParseThreadsOption(optionsObj, "threads", options.threads);
+    ParseThreadsOption(optionsObj, "threadsBatch", options.threadsBatch);
 
     if (optionsObj.Has("nCtx") && optionsObj.Get("nCtx").IsNumber())
     {
@@ -533,298 +5110,201 @@ CreateContextOptions ParseCreateContextOptions(const Napi::CallbackInfo &info)
         options.flashAttention = optionsObj.Get("flashAttention").As<Napi::Boolean>().Value();
     }
 
-    return options;
-}
+    if (!ParseCacheTypeOption(optionsObj, "typeK", options.typeK) || !ParseCacheTypeOption(optionsObj, "typeV", options.typeV))
+    {
+        Napi::TypeError::New(env, "Unknown KV cache type").ThrowAsJavaScriptException();
+        return {};
+    }
 
-Napi::Value CreateContextAsync(const Napi::CallbackInfo &info)
-{
-    Napi::Env env = info.Env();
-    CreateContextOptions options = ParseCreateContextOptions(info);
+    //  Quantized V is only read by the flash attention kernel
+    if (ggml_is_quantized(options.typeV) && !options.flashAttention)
+    {
+        Napi::TypeError::New(env, "Quantized typeV requires flashAttention").ThrowAsJavaScriptException();
+        return {};
+    }
 
-    if (options.model == nullptr)
+    if (optionsObj.Has("maxSequences") && optionsObj.Get("maxSequences").IsNumber())
     {
-        Napi::TypeError::New(env, "Invalid model handle").ThrowAsJavaScriptException();
-        return env.Undefined();
+        options.maxSequences = optionsObj.Get("maxSequences").As<Napi::Number>().Int32Value();
     }
 
-    CreateContextWorker *worker = new CreateContextWorker(env, options.model, options.threads, options.nCtx, options.flashAttention);
-    worker->Queue();
+    if (optionsObj.Has("batchSize") && optionsObj.Get("batchSize").IsNumber())
+    {
+        options.batchSize = optionsObj.Get("batchSize").As<Napi::Number>().Int32Value();
+    }
 
-    return worker->GetPromise();
-}
+    if (optionsObj.Has("nCtxInit") && optionsObj.Get("nCtxInit").IsNumber())
+    {
+        options.nCtxInit = optionsObj.Get("nCtxInit").As<Napi::Number>().Int32Value();
+    }
 
-struct StreamData
-{
-    std::string text;
-    bool done;
-};
+    return options;
+}
 
-class InferenceWorker : public Napi::AsyncProgressWorkerBase<StreamData>
+class CreateBatchEngineWorker : public PoolWorker
 {
 public:
-    InferenceWorker(const Napi::Object &receiver,
-                    const Napi::Function &callback,
-                    llama_model *model,
-                    llama_context *context,
-                    const std::string &systemPrompt,
-                    const std::string &userPrompt,
-                    int maxTokens,
-                    size_t seed)
-        : Napi::AsyncProgressWorkerBase<StreamData>(receiver, callback, "InferenceWorker", {}),
-          _model(model),
-          _context(context),
-          _systemPrompt(systemPrompt),
-          _userPrompt(userPrompt),
-          _maxTokens(maxTokens),
-          _seed(seed)
-    {
-    }
+    CreateBatchEngineWorker(Napi::Env &env, const CreateBatchEngineOptions &options)
+        : PoolWorker(env, "CreateBatchEngineWorker"), _options(options), _deferred(Napi::Promise::Deferred::New(env)) {}
 
     void Execute() override
     {
-        if (!_model || !_context)
+        llama_context_params ctx_params = buildContextParams(_options.threads, _options.nCtx, _options.flashAttention);
+        ctx_params.type_k = _options.typeK;
+        ctx_params.type_v = _options.typeV;
+        ctx_params.n_seq_max = _options.maxSequences;
+        ctx_params.n_batch = _options.batchSize;
+        if (_options.threadsBatch != 0)
         {
-            SetError("Invalid model or context handle");
-            return;
+            ctx_params.n_threads_batch = _options.threadsBatch;
         }
-
-        stream_callback_info streamInfo;
-        streamInfo.callback = [](const std::string &text, bool done, void *data)
-        {
-            auto worker = static_cast<InferenceWorker *>(data);
-            // Create StreamData on heap as it needs to persist until processed
-            auto progress = new StreamData{text, done};
-            worker->NonBlockingCall(progress);
-        };
-        streamInfo.data = this;
-
-        _result = runInference(_model, _context, _systemPrompt, _userPrompt, _maxTokens, _seed, &streamInfo);
-
-        if (_result.empty())
+        if (_options.nCtxInit >= 0)
         {
-            SetError("Failed to run inference");
+            ctx_params.n_ctx_init = _options.nCtxInit;
         }
-    }
 
-    void OnWorkProgress(StreamData *data) override
-    {
-        if (data)
+        context_handle *context = createContext(_options.model, ctx_params);
+        if (context == nullptr)
         {
-            // Call the JavaScript callback with the token data
-            Callback().Call({Env().Null(), Napi::String::New(Env(), data->text), Napi::Boolean::New(Env(), data->done)});
-
-            // Clean up the heap-allocated StreamData
-            delete data;
+            SetError("Failed to create context");
+            return;
         }
+
+        _engine = new batch_engine(_options.model, context);
     }
 
     void OnOK() override
     {
-        Napi::HandleScope scope(Env());
-        Callback().Call({
-            Env().Null(),                     // error arg
-            Napi::String::New(Env(), _result) // result arg
-        });
+        Napi::Env env = _deferred.Env();
+        _deferred.Resolve(Napi::External<batch_engine>::New(env, _engine));
     }
 
     void OnError(const Napi::Error &error) override
     {
-        Napi::HandleScope scope(Env());
-        Callback().Call({Napi::String::New(Env(), error.Message()),
-                         Env().Null()});
+        _deferred.Reject(error.Value());
+    }
+
+    Napi::Promise GetPromise() const
+    {
+        return _deferred.Promise();
     }
 
 private:
-    llama_model *_model;
-    llama_context *_context;
-    std::string _systemPrompt;
-    std::string _userPrompt;
-    int _maxTokens;
-    size_t _seed;
-    std::string _result;
+    CreateBatchEngineOptions _options;
+    batch_engine *_engine = nullptr;
+    Napi::Promise::Deferred _deferred;
 };
 
-struct RunInferenceAsyncOptions
+Napi::Value CreateBatchEngineAsync(const Napi::CallbackInfo &info)
 {
-    llama_model *model;
-    llama_context *context;
-    std::string prompt;
-    std::string systemPrompt;
-    int maxTokens = 1024;
-    size_t seed = LLAMA_DEFAULT_SEED;
-    Napi::FunctionReference callback;
-};
+    Napi::Env env = info.Env();
+    CreateBatchEngineOptions options = ParseCreateBatchEngineOptions(info);
 
-RunInferenceAsyncOptions ParseRunInferenceAsyncOptions(const Napi::CallbackInfo &info)
+    if (options.model == nullptr || options.maxSequences < 1 || options.batchSize < options.maxSequences)
+    {
+        Napi::TypeError::New(env, "Invalid options object").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+
+    CreateBatchEngineWorker *worker = new CreateBatchEngineWorker(env, options);
+    worker->Queue();
+
+    return worker->GetPromise();
+}
+
+Napi::Value RunBatchInferenceAsync(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
     if (info.Length() < 1 || !info[0].IsObject())
     {
         Napi::TypeError::New(env, "Expected an options object").ThrowAsJavaScriptException();
-        return {};
+        return env.Undefined();
     }
 
     Napi::Object optionsObj = info[0].As<Napi::Object>();
-    RunInferenceAsyncOptions options;
 
-    if (optionsObj.Has("model") && optionsObj.Get("model").IsExternal())
-    {
-        options.model = optionsObj.Get("model").As<Napi::External<llama_model>>().Data();
-    }
-    else
+    if (!optionsObj.Has("engine") || !optionsObj.Get("engine").IsExternal())
     {
-        Napi::TypeError::New(env, "model is required and should be an external").ThrowAsJavaScriptException();
-        return {};
+        Napi::TypeError::New(env, "engine is required and should be an external").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
 
-    if (optionsObj.Has("context") && optionsObj.Get("context").IsExternal())
-    {
-        options.context = optionsObj.Get("context").As<Napi::External<llama_context>>().Data();
-    }
-    else
+    std::string prompt;
+    token_view promptTokens;
+    if (!ParsePromptOption(optionsObj, prompt, promptTokens))
     {
-        Napi::TypeError::New(env, "context is required and should be an external").ThrowAsJavaScriptException();
-        return {};
+        return env.Undefined();
     }
 
-    if (optionsObj.Has("prompt") && optionsObj.Get("prompt").IsString())
-    {
-        options.prompt = optionsObj.Get("prompt").As<Napi::String>().Utf8Value();
-    }
-    else
+    batch_engine *engine = optionsObj.Get("engine").As<Napi::External<batch_engine>>().Data();
+    if (!tokensInVocab(engine->model(), promptTokens))
     {
-        Napi::TypeError::New(env, "prompt is required and should be a string").ThrowAsJavaScriptException();
-        return {};
+        Napi::TypeError::New(env, "Prompt token id out of range").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
 
+    batch_request *request = new batch_request();
+    request->userPrompt = std::move(prompt);
+    request->promptTokens.assign(promptTokens.data(), promptTokens.data() + promptTokens.size());
+    request->maxTokens = 1024;
+    request->seed = LLAMA_DEFAULT_SEED;
+
     if (optionsObj.Has("systemPrompt") && optionsObj.Get("systemPrompt").IsString())
     {
-        options.systemPrompt = optionsObj.Get("systemPrompt").As<Napi::String>().Utf8Value();
+        request->systemPrompt = optionsObj.Get("systemPrompt").As<Napi::String>().Utf8Value();
     }
 
     if (optionsObj.Has("maxTokens") && optionsObj.Get("maxTokens").IsNumber())
     {
-        options.maxTokens = optionsObj.Get("maxTokens").As<Napi::Number>().Int32Value();
+        request->maxTokens = optionsObj.Get("maxTokens").As<Napi::Number>().Int32Value();
     }
 
     if (optionsObj.Has("seed") && optionsObj.Get("seed").IsNumber())
     {
-        options.seed = optionsObj.Get("seed").As<Napi::Number>().Uint32Value();
-    }
-
-    if (optionsObj.Has("onStream") && optionsObj.Get("onStream").IsFunction())
-    {
-        options.callback = Napi::Persistent(optionsObj.Get("onStream").As<Napi::Function>());
+        request->seed = optionsObj.Get("seed").As<Napi::Number>().Uint32Value();
     }
 
-    return options;
-}
-
-Napi::Value RunInferenceAsync(const Napi::CallbackInfo &info)
-{
-    Napi::Env env = info.Env();
-    RunInferenceAsyncOptions options = ParseRunInferenceAsyncOptions(info);
-
-    if (options.model == nullptr || options.context == nullptr || options.prompt.empty())
+    request->sampling = ParseSamplingOptions(optionsObj);
+    if (!ParseGrammarOptions(optionsObj, engine->model(), request->sampling))
     {
-        Napi::TypeError::New(env, "Invalid options object").ThrowAsJavaScriptException();
+        delete request;
         return env.Undefined();
     }
 
-    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
-    auto reciever = Napi::Object::New(env);
-
-    auto callback = Napi::Function::New(env, [env, deferred, streamCallback = std::move(options.callback)](const Napi::CallbackInfo &info)
-                                        {
-        // First argument is error, second is either a token or final result
-        if (info[0].IsNull()) {
-            // No error - check if this is a token or final result
-            if (info.Length() > 2 && !info[2].IsUndefined()) {
-                // This is a token (streaming update)
-                if (!streamCallback.IsEmpty()) {
-                    streamCallback.Call({info[1], info[2]});
-                }
-            } else {
-                // This is the final result
-                deferred.Resolve(info[1]);
-            }
-        } else {
-            // Error occurred
-            deferred.Reject(info[0].As<Napi::String>());
-        } }, "InferenceCallback");
-
-    InferenceWorker *worker = new InferenceWorker(reciever, callback, options.model, options.context, options.systemPrompt, options.prompt, options.maxTokens, options.seed);
-    worker->Queue();
-
-    return deferred.Promise();
-}
-
-class ReleaseContextWorker : public Napi::AsyncWorker
-{
-public:
-    ReleaseContextWorker(Napi::Env &env, llama_context *context)
-        : Napi::AsyncWorker(env), _context(context), _deferred(Napi::Promise::Deferred::New(env)) {}
-
-    void Execute() override
-    {
-        if (_context)
-        {
-            llama_free(_context);
-        }
-    }
-
-    void OnOK() override
-    {
-        Napi::Env env = _deferred.Env();
-        _deferred.Resolve(env.Undefined());
-    }
-
-    void OnError(const Napi::Error &error) override
-    {
-        _deferred.Reject(error.Value());
-    }
-
-    Napi::Promise GetPromise() const
+    int timeoutMs = 0;
+    if (optionsObj.Has("timeoutMs") && optionsObj.Get("timeoutMs").IsNumber())
     {
-        return _deferred.Promise();
+        timeoutMs = optionsObj.Get("timeoutMs").As<Napi::Number>().Int32Value();
     }
 
-private:
-    llama_context *_context;
-    Napi::Promise::Deferred _deferred;
-};
-
-Napi::Value ReleaseContextAsync(const Napi::CallbackInfo &info)
-{
-    Napi::Env env = info.Env();
+    std::shared_ptr<abort_listener> listener;
+    request->cancel = CreateCancelState(optionsObj.Get("signal"), timeoutMs, listener);
 
-    if (info.Length() < 1 || !info[0].IsExternal())
+    Napi::FunctionReference streamCallback;
+    if (optionsObj.Has("onStream") && optionsObj.Get("onStream").IsFunction())
     {
-        Napi::TypeError::New(env, "Context handle expected").ThrowAsJavaScriptException();
-        return env.Undefined();
+        streamCallback = Napi::Persistent(optionsObj.Get("onStream").As<Napi::Function>());
     }
 
-    llama_context *context = info[0].As<Napi::External<llama_context>>().Data();
+    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+    auto callback = CreateInferenceCallback(env, deferred, std::move(streamCallback), listener);
+    request->tsfn = Napi::ThreadSafeFunction::New(env, callback, "BatchInference", 0, 1);
 
-    ReleaseContextWorker *worker = new ReleaseContextWorker(env, context);
-    worker->Queue();
+    engine->enqueue(request);
 
-    return worker->GetPromise();
+    return deferred.Promise();
 }
 
-class ReleaseModelWorker : public Napi::AsyncWorker
+class ReleaseBatchEngineWorker : public PoolWorker
 {
 public:
-    ReleaseModelWorker(Napi::Env &env, llama_model *model)
-        : Napi::AsyncWorker(env), _model(model), _deferred(Napi::Promise::Deferred::New(env)) {}
+    ReleaseBatchEngineWorker(Napi::Env &env, batch_engine *engine)
+        : PoolWorker(env, "ReleaseBatchEngineWorker"), _engine(engine), _deferred(Napi::Promise::Deferred::New(env)) {}
 
     void Execute() override
     {
-        if (_model)
-        {
-            llama_free_model(_model);
-        }
+        delete _engine;
     }
 
     void OnOK() override
@@ -844,23 +5324,23 @@ public:
     }
 
 private:
-    llama_model *_model;
+    batch_engine *_engine;
     Napi::Promise::Deferred _deferred;
 };
 
-Napi::Value ReleaseModelAsync(const Napi::CallbackInfo &info)
+Napi::Value ReleaseBatchEngineAsync(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
     if (info.Length() < 1 || !info[0].IsExternal())
     {
-        Napi::TypeError::New(env, "Model handle expected").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Engine handle expected").ThrowAsJavaScriptException();
         return env.Undefined();
     }
 
-    llama_model *model = info[0].As<Napi::External<llama_model>>().Data();
+    batch_engine *engine = info[0].As<Napi::External<batch_engine>>().Data();
 
-    ReleaseModelWorker *worker = new ReleaseModelWorker(env, model);
+    ReleaseBatchEngineWorker *worker = new ReleaseBatchEngineWorker(env, engine);
     worker->Queue();
 
     return worker->GetPromise();
@@ -871,15 +5351,38 @@ Napi::Object Init(Napi::Env env, Napi::Object exports)
 {
     exports.Set("SetLogLevel", Napi::Function::New(env, SetLogLevel));
     exports.Set("GetModelToken", Napi::Function::New(env, GetModelToken));
+    exports.Set("SetModelCacheBudget", Napi::Function::New(env, SetModelCacheBudget));
+    exports.Set("SetWorkerThreads", Napi::Function::New(env, SetWorkerThreads));
 
     exports.Set("RunInference", Napi::Function::New(env, RunInference));
 
+    exports.Set("CreateChat", Napi::Function::New(env, CreateChat));
+    exports.Set("GetChatHistory", Napi::Function::New(env, GetChatHistory));
+
+    exports.Set("CreateThreadpool", Napi::Function::New(env, CreateThreadpool));
+    exports.Set("GetContextInfo", Napi::Function::New(env, GetContextInfo));
+    exports.Set("GetNumaLayout", Napi::Function::New(env, GetNumaLayout));
+
     exports.Set("LoadModelAsync", Napi::Function::New(env, LoadModelAsync));
     exports.Set("CreateContextAsync", Napi::Function::New(env, CreateContextAsync));
     exports.Set("RunInferenceAsync", Napi::Function::New(env, RunInferenceAsync));
     exports.Set("ReleaseContextAsync", Napi::Function::New(env, ReleaseContextAsync));
     exports.Set("ReleaseModelAsync", Napi::Function::New(env, ReleaseModelAsync));
 
+    exports.Set("SaveSessionAsync", Napi::Function::New(env, SaveSessionAsync));
+    exports.Set("LoadSessionAsync", Napi::Function::New(env, LoadSessionAsync));
+    exports.Set("CreateSnapshotAsync", Napi::Function::New(env, CreateSnapshotAsync));
+    exports.Set("RestoreSnapshotAsync", Napi::Function::New(env, RestoreSnapshotAsync));
+
+    exports.Set("TokenizeAsync", Napi::Function::New(env, TokenizeAsync));
+    exports.Set("DetokenizeAsync", Napi::Function::New(env, DetokenizeAsync));
+
+    exports.Set("EmbedAsync", Napi::Function::New(env, EmbedAsync));
+
+    exports.Set("CreateBatchEngineAsync", Napi::Function::New(env, CreateBatchEngineAsync));
+    exports.Set("RunBatchInferenceAsync", Napi::Function::New(env, RunBatchInferenceAsync));
+    exports.Set("ReleaseBatchEngineAsync", Napi::Function::New(env, ReleaseBatchEngineAsync));
+
     exports.Set("LLAMA_DEFAULT_SEED", static_cast<int>(LLAMA_DEFAULT_SEED));
 
     return exports;
@@ -0,0 +1,79 @@
+#!/usr/bin/env node
+
+import { Command } from 'commander';
+import { readFileSync } from 'fs';
+import { LoadModelAsync, ReleaseModelAsync, TokenizeAsync } from "../src";
+import { version } from './version';
+
+const program = new Command();
+program
+  .version(version)
+  .requiredOption('-m, --model <path>', 'Path to the model')
+  .option('-f, --file <path>', 'Corpus file, a generated one is used when missing')
+  .option('-s, --size <mb>', 'Size of the generated corpus in MB', "8")
+  .option('-c, --chunk <kb>', 'Chunk size in KB', "64")
+  .option('-r, --runs <number>', 'Timed runs, the best one is reported', "3");
+
+program.parse(process.argv);
+
+interface ProgramOptions {
+  model: string;
+  file?: string;
+  size: string;
+  chunk: string;
+  runs: string;
+}
+
+const options = program.opts() as ProgramOptions;
+
+//  Same text on every run and machine, a mix of prose, code, numbers and non latin scripts
+const generateCorpus = (bytes: number): string => {
+  const words = [
+    "the", "duck", "swims", "across", "a", "quiet", "pond", "and", "eats", "bread", "while", "geese",
+    "watch", "from", "shore", "function", "return", "const", "if", "else", "=>", "{", "}", "();",
+    "0.5", "1024", "3.14159", "2025-01-01", "café", "naïve", "日本語", "テキスト", "🦆", "—", "\n", "\t",
+  ];
+  let seed = 12345;
+  const parts: string[] = [];
+  let length = 0;
+  while (length < bytes) {
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+    const word = words[seed % words.length];
+    parts.push(word);
+    length += Buffer.byteLength(word) + 1;
+  }
+  return parts.join(" ");
+}
+
+const run = async () => {
+  const corpus = options.file ? readFileSync(options.file, "utf8") : generateCorpus(parseFloat(options.size) * 1024 * 1024);
+  const chunkSize = parseInt(options.chunk) * 1024;
+  const chunks: string[] = [];
+  for (let i = 0; i < corpus.length; i += chunkSize) {
+    chunks.push(corpus.slice(i, i + chunkSize));
+  }
+  const megabytes = Buffer.byteLength(corpus) / (1024 * 1024);
+
+  const model = await LoadModelAsync(options.model);
+
+  let best = Infinity;
+  let tokens = 0;
+  for (let i = 0; i < parseInt(options.runs); i++) {
+    const start = process.hrtime.bigint();
+    const result = await TokenizeAsync(model, chunks, { addSpecial: false });
+    const seconds = Number(process.hrtime.bigint() - start) / 1e9;
+    tokens = result.reduce((sum, t) => sum + t.length, 0);
+    best = Math.min(best, seconds);
+    console.log(`Run ${i + 1}: ${(megabytes / seconds).toFixed(2)} MB/s`);
+  }
+
+  await ReleaseModelAsync(model);
+
+  console.log(`Corpus ${megabytes.toFixed(2)} MB in ${chunks.length} chunks, ${tokens} tokens`);
+  console.log(`Best ${(megabytes / best).toFixed(2)} MB/s, ${(tokens / best / 1e6).toFixed(2)} M tokens/s`);
+}
+
+run().catch((error: Error) => {
+  console.error(error.message);
+  process.exit(1);
+});